@@ -2,85 +2,504 @@
 #define LIBROBOCOL_BUFCACHE_H
 
 #include <vector>
+#include <array>
+#include <bit>
 #include <assert.h>
 #include <algorithm>
 
 #include "sync.h"
 #include "FixedBuf.h"
 
+// Per-thread magazines in front of the shared free lists. Off on the Wii, where devkitPPC's
+// thread_local isn't per LWP thread, and where the depot's lock only masks interrupts anyway.
+#ifndef LIBROBOCOL_BUF_MAGAZINES
+#ifdef GEKKO
+#define LIBROBOCOL_BUF_MAGAZINES 0
+#else
+#define LIBROBOCOL_BUF_MAGAZINES 1
+#endif
+#endif
+
 namespace librobocol
 {
+    // Largest datagram robocol sends or receives
+    constexpr size_t MAX_PACKET_SIZE = 55000;
+
     // Singleton storage for caching read/write buffers
+    // Buffers are sorted into power of two size classes from 64 bytes to 64 KiB. Each class keeps
+    // its own free list, so getting and recycling a buffer is a push or pop on that list. Once the
+    // lists have warmed up (or been filled by reserve()), the send path stops allocating entirely.
+    // Every buffer handed out names BufCache as its owner, so it comes back here by itself when its
+    // last handle is dropped, whichever thread that happens on.
+    //
+    // The free lists are a global depot behind a lock. In front of it, each thread keeps a small
+    // magazine of buffers per class that it gets from and recycles into without locking. Only when
+    // a magazine runs dry or overflows does the thread take the lock, and then it moves half a
+    // magazine at once, so threads that each get and recycle their own buffers hardly ever meet.
+    // A thread's magazines go back to the depot when it exits.
     class BufCache
     {
     public:
-        static std::vector<FixedBuf> freeBufs;
+        static constexpr size_t MIN_CLASS_SHIFT = 6; // 64 bytes
+        static constexpr size_t CLASS_COUNT = 11; // 64 bytes to 64 KiB, which covers MAX_PACKET_SIZE
+        static constexpr size_t MAX_BUF_SIZE = size_t(1) << (CLASS_COUNT - 1 + MIN_CLASS_SHIFT); // Size of the largest class
+        static constexpr size_t DEFAULT_CLASS_CAP = 16;
 
-        // Avoid memory leaks by storing a list of buffers that may or may not still exist
-        // static std::vector<std::reference_wrapper<FixedBuf>> allBufs;
+        // Most buffers of any class a magazine holds, and about how many bytes one holds at most
+        static constexpr size_t MAGAZINE_SIZE = 8;
+        static constexpr size_t MAGAZINE_BYTES = 64 * 1024;
 
-        STATIC_SYNCHRONIZED_CLASS
+        // The depot's view of a class
+        struct ClassStats
+        {
+            size_t hits = 0; // Buffers handed to a thread from the free list
+            size_t misses = 0; // getBuf() found the free list empty and allocated
+            size_t recycled = 0; // Buffers put back on the free list
+            size_t dropped = 0; // Buffers freed because the free list was at its cap
+            size_t live = 0; // Buffers allocated and not yet freed, wherever they are
+            size_t highWater = 0; // Most buffers ever live at once
+        };
 
-        // Get the smallest power of 2 equal to or greater than x
-        static size_t nearestPower(size_t size)
+        // One thread's view of a class, which is what shows whether the magazines are doing their job
+        struct LocalStats
         {
-            size_t val = 1 << (32 - __builtin_clz(size - 1));
+            size_t gets = 0;
+            size_t localHits = 0; // getBuf() served from the magazine, without locking
+            size_t refills = 0; // The magazine was empty and took a batch from the depot
+            size_t releases = 0;
+            size_t localRecycles = 0; // Released into the magazine, without locking
+            size_t flushes = 0; // The magazine was full and gave a batch back to the depot
+
+            double hitRate() const
+            {
+                return gets > 0 ? (double)localHits / gets : 0;
+            }
 
-            printf("rounded %u to %u\n", size, val);
+            double recycleRate() const
+            {
+                return releases > 0 ? (double)localRecycles / releases : 0;
+            }
+        };
+
+        // Free storage of one size class, freed for good at exit
+        // Room for the cap is reserved up front, so pushing onto it under the lock never allocates.
+        struct FreeList
+        {
+            std::vector<BufHeader *> bufs;
 
-            return val;
+            FreeList()
+            {
+                bufs.reserve(DEFAULT_CLASS_CAP);
+            }
+
+            ~FreeList()
+            {
+                for (BufHeader *header : bufs)
+                {
+                    BufHeader::free(header);
+                }
+            }
+        };
+
+        static std::array<FreeList, CLASS_COUNT> freeBufs;
+        static std::array<size_t, CLASS_COUNT> classCaps;
+        static std::array<ClassStats, CLASS_COUNT> stats;
+
+        // Every critical section is a few loads and stores, and nothing is allocated or freed in one
+        STATIC_SYNCHRONIZED_CLASS_WITH(SpinLock)
+
+    private:
+#if LIBROBOCOL_BUF_MAGAZINES
+        struct Magazine
+        {
+            std::array<BufHeader *, MAGAZINE_SIZE> bufs;
+            size_t count = 0;
+        };
+
+        // Trivially destructible, so it is still there for buffers released after its thread's
+        // exit handlers have run. By then retired is set and they go straight to the depot.
+        struct LocalCache
+        {
+            std::array<Magazine, CLASS_COUNT> magazines;
+            std::array<LocalStats, CLASS_COUNT> stats;
+            bool registered = false;
+            bool retired = false;
+        };
+
+        // Gives the thread's magazines back when it exits
+        struct LocalFlusher
+        {
+            ~LocalFlusher()
+            {
+                flushLocal();
+            }
+        };
+
+        static thread_local LocalCache local;
+        static thread_local LocalFlusher flusher;
+
+        // Magazine size for a class, so a thread holds about MAGAZINE_BYTES of each class at most
+        static constexpr size_t magazineSize(size_t cls)
+        {
+            return std::clamp<size_t>(MAGAZINE_BYTES / classSize(cls), 2, MAGAZINE_SIZE);
         }
 
-        static FixedBuf getBuf(size_t size)
+        // Move up to half a magazine from the depot into it
+        static void refill(size_t cls, Magazine &magazine)
+        {
+            auto l = lock();
+
+            std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+            ClassStats &stat = stats[cls];
+
+            size_t count = std::min(list.size(), magazineSize(cls) / 2);
+            std::copy(list.end() - count, list.end(), magazine.bufs.begin() + magazine.count);
+            list.resize(list.size() - count);
+            magazine.count += count;
+            stat.hits += count;
+
+            if (count == 0)
+            {
+                stat.misses++;
+                stat.live++;
+                stat.highWater = std::max(stat.highWater, stat.live);
+            }
+        }
+
+        // Move the top count buffers of a magazine to the depot, freeing any that don't fit
+        static void flush(size_t cls, Magazine &magazine, size_t count)
         {
-            assert(size < 55001);
+            BufHeader *extra[MAGAZINE_SIZE];
+            size_t extraCount = 0;
+
+            {
+                auto l = lock();
+
+                std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+                ClassStats &stat = stats[cls];
+
+                for (; count > 0; count--)
+                {
+                    BufHeader *header = magazine.bufs[--magazine.count];
+                    if (list.size() < classCaps[cls])
+                    {
+                        stat.recycled++;
+                        list.push_back(header);
+                    }
+                    else
+                    {
+                        stat.dropped++;
+                        stat.live--;
+                        extra[extraCount++] = header;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < extraCount; i++)
+            {
+                BufHeader::free(extra[i]);
+            }
+        }
 
+        // The calling thread's magazines, or null once it has exited
+        static LocalCache *localCache()
+        {
+            LocalCache &cache = local;
+            if (cache.retired)
+            {
+                return nullptr;
+            }
+
+            // Touching the flusher is what registers it to run at thread exit
+            if (!cache.registered)
+            {
+                cache.registered = true;
+                (void)&flusher;
+            }
+            return &cache;
+        }
+
+        static void flushAll(LocalCache &cache)
+        {
+            for (size_t cls = 0; cls < CLASS_COUNT; cls++)
+            {
+                flush(cls, cache.magazines[cls], cache.magazines[cls].count);
+            }
+        }
+
+        static void flushLocal()
+        {
+            flushAll(local);
+            local.retired = true;
+        }
+#endif
+
+        // Straight from the depot, one buffer at a time. Null if it is empty.
+        static BufHeader *takeFromDepot(size_t cls)
+        {
             auto l = lock();
 
-            // nearestPower ROUNDS UP
-            //size_t closest = nearestPower(size);
-            size_t closest = size;
+            std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+            ClassStats &stat = stats[cls];
+
+            if (list.empty())
+            {
+                stat.misses++;
+                stat.live++;
+                stat.highWater = std::max(stat.highWater, stat.live);
+                return nullptr;
+            }
 
-            auto itr = std::find_if(freeBufs.begin(), freeBufs.end(),
-                                    [closest](FixedBuf &val)
-                                    { return val.len == closest; });
+            stat.hits++;
+            BufHeader *header = list.back();
+            list.pop_back();
+            return header;
+        }
 
-            if (itr == freeBufs.end())
+        static void returnToDepot(size_t cls, BufHeader *header)
+        {
             {
-                FixedBuf buf(closest);
-                //buf.len = size;
-                return buf;
+                auto l = lock();
+
+                std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+                ClassStats &stat = stats[cls];
+
+                if (list.size() < classCaps[cls])
+                {
+                    stat.recycled++;
+                    list.push_back(header);
+                    return;
+                }
+
+                stat.dropped++;
+                stat.live--;
             }
-            else
+
+            BufHeader::free(header);
+        }
+
+    public:
+        // Index of the smallest class that can hold size bytes
+        static constexpr size_t sizeClass(size_t size)
+        {
+            if (size <= (size_t(1) << MIN_CLASS_SHIFT))
             {
-                //todo: prevent bufs gradually losing size?
-                size_t dist = std::distance(freeBufs.begin(), itr);
-                FixedBuf buf = std::move(freeBufs[dist]);
-                freeBufs.erase(itr);
-                buf.len = size;
+                return 0;
+            }
 
-                removeFreeBufs();
+            return std::bit_width(size - 1) - MIN_CLASS_SHIFT;
+        }
 
-                return buf;
+        static constexpr size_t classSize(size_t cls)
+        {
+            return size_t(1) << (cls + MIN_CLASS_SHIFT);
+        }
+
+        // A buffer of size bytes, or an invalid one if size is more than the largest class holds
+        static FixedBuf getBuf(size_t size)
+        {
+            if (size > MAX_BUF_SIZE)
+            {
+                LOG_WARN("Buffer of %u bytes is larger than any class\n", (unsigned)size);
+                return FixedBuf();
             }
+
+            size_t cls = sizeClass(size);
+
+            BufHeader *header = nullptr;
+#if LIBROBOCOL_BUF_MAGAZINES
+            if (LocalCache *cache = localCache())
+            {
+                Magazine &magazine = cache->magazines[cls];
+                LocalStats &stat = cache->stats[cls];
+                stat.gets++;
+
+                if (magazine.count > 0)
+                {
+                    stat.localHits++;
+                }
+                else
+                {
+                    stat.refills++;
+                    refill(cls, magazine);
+                }
+
+                if (magazine.count > 0)
+                {
+                    header = magazine.bufs[--magazine.count];
+                }
+            }
+            else
+            {
+                header = takeFromDepot(cls);
+            }
+#else
+            header = takeFromDepot(cls);
+#endif
+
+            if (header == nullptr)
+            {
+                return FixedBuf(size, classSize(cls), &BufCache::release);
+            }
+            return FixedBuf::adopt(header, size);
         }
 
+        // Done with a buffer. It comes back here once nobody holds a share of it (a parsed packet
+        // viewing a datagram, say), which is also what dropping it any other way does.
         static void recycle(FixedBuf &&buf)
         {
+            buf.reset();
+        }
+
+        // The last handle to one of our buffers went away
+        static void release(BufHeader *header)
+        {
+            size_t cls = sizeClass(header->cap);
+
+#if LIBROBOCOL_BUF_MAGAZINES
+            if (LocalCache *cache = localCache())
+            {
+                Magazine &magazine = cache->magazines[cls];
+                LocalStats &stat = cache->stats[cls];
+                stat.releases++;
+
+                if (magazine.count >= magazineSize(cls))
+                {
+                    stat.flushes++;
+                    flush(cls, magazine, magazineSize(cls) / 2);
+                }
+                else
+                {
+                    stat.localRecycles++;
+                }
+
+                magazine.bufs[magazine.count++] = header;
+                return;
+            }
+#endif
+
+            returnToDepot(cls, header);
+        }
+
+        // Limit how many free buffers a class keeps around. Extra ones are freed on recycle.
+        static void setClassCap(size_t cls, size_t cap)
+        {
+            assert(cls < CLASS_COUNT);
+
+            // The list is swapped for one with room for the new cap, made outside the lock, and
+            // whatever no longer fits is freed outside it too
+            std::vector<BufHeader *> resized;
+            resized.reserve(cap);
+            {
+                auto l = lock();
+
+                std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+                classCaps[cls] = cap;
+
+                size_t keep = std::min(list.size(), cap);
+                resized.assign(list.end() - keep, list.end());
+                list.resize(list.size() - keep);
+                list.swap(resized);
+                stats[cls].live -= resized.size();
+            }
+
+            for (BufHeader *header : resized)
+            {
+                BufHeader::free(header);
+            }
+        }
+
+        // Allocate count buffers able to hold size bytes up front, so the first packets don't miss
+        static void reserve(size_t size, size_t count)
+        {
+            if (size > MAX_BUF_SIZE)
+            {
+                return;
+            }
+
+            size_t cls = sizeClass(size);
+
+            std::vector<BufHeader *> fresh;
+            {
+                auto l = lock();
+                count = std::min(count, classCaps[cls]);
+                count -= std::min(count, freeBufs[cls].bufs.size());
+            }
+
+            fresh.reserve(count);
+            while (fresh.size() < count)
+            {
+                fresh.push_back(BufHeader::allocate(classSize(cls), &BufCache::release));
+            }
+
+            {
+                auto l = lock();
+
+                std::vector<BufHeader *> &list = freeBufs[cls].bufs;
+                ClassStats &stat = stats[cls];
+                while (!fresh.empty() && list.size() < classCaps[cls])
+                {
+                    list.push_back(fresh.back());
+                    fresh.pop_back();
+                    stat.live++;
+                }
+                stat.highWater = std::max(stat.highWater, stat.live);
+            }
+
+            // Another thread filled the list in the meantime
+            for (BufHeader *header : fresh)
+            {
+                BufHeader::free(header);
+            }
+        }
+
+        static ClassStats getStats(size_t cls)
+        {
+            assert(cls < CLASS_COUNT);
+
             auto l = lock();
+            return stats[cls];
+        }
 
-            //freeBufs.emplace_back(FixedBuf());
+        // The calling thread's magazine stats for a class. All zero without magazines.
+        static LocalStats getLocalStats(size_t cls)
+        {
+            assert(cls < CLASS_COUNT);
 
-            freeBufs.emplace_back(std::move(buf));
+#if LIBROBOCOL_BUF_MAGAZINES
+            return local.stats[cls];
+#else
+            return LocalStats();
+#endif
         }
 
-        static void removeFreeBufs()
+        // Give the calling thread's magazines back to the depot early, as exiting would
+        static void flushThread()
         {
-            std::remove_if(freeBufs.begin(), freeBufs.end(), [](const FixedBuf& buf) { return buf.len == 0; });
+#if LIBROBOCOL_BUF_MAGAZINES
+            if (LocalCache *cache = localCache())
+            {
+                flushAll(*cache);
+            }
+#endif
         }
     };
-    Mutex BufCache::accessM = {};
-    std::vector<FixedBuf> BufCache::freeBufs = {};
+    static_assert(BufCache::MAX_BUF_SIZE == BufCache::classSize(BufCache::CLASS_COUNT - 1), "MAX_BUF_SIZE must be the largest class");
+    static_assert(MAX_PACKET_SIZE <= BufCache::MAX_BUF_SIZE, "The largest class must hold a whole datagram");
+
+    SpinLock BufCache::accessM = {};
+    std::array<BufCache::FreeList, BufCache::CLASS_COUNT> BufCache::freeBufs = {};
+    std::array<size_t, BufCache::CLASS_COUNT> BufCache::classCaps = []()
+    {
+        std::array<size_t, BufCache::CLASS_COUNT> caps;
+        caps.fill(BufCache::DEFAULT_CLASS_CAP);
+        return caps;
+    }();
+    std::array<BufCache::ClassStats, BufCache::CLASS_COUNT> BufCache::stats = {};
+#if LIBROBOCOL_BUF_MAGAZINES
+    thread_local BufCache::LocalCache BufCache::local = {};
+    thread_local BufCache::LocalFlusher BufCache::flusher;
+#endif
 }
 
-#endif // if !defined(LIBROBOCOL_BUFCACHE_H)
\ No newline at end of file
+#endif // if !defined(LIBROBOCOL_BUFCACHE_H)
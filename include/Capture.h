@@ -0,0 +1,292 @@
+#if !defined(LIBROBOCOL_CAPTURE_H)
+#define LIBROBOCOL_CAPTURE_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#include "log.h"
+#include "FixedBuf.h"
+#include "BufCache.h"
+#include "GatherBuf.h"
+#include "SpscRing.h"
+#include "Thread.h"
+#include "robocol/layout.h"
+
+namespace librobocol
+{
+    // Records every datagram a socket sends or receives to a file, for replaying later
+    // The file is MAGIC followed by one record per datagram:
+    //   1 byte    direction
+    //   8 bytes   currentTimeNs() when it was read or sent (big endian)
+    //   2 bytes   datagram length (big endian)
+    //   ...       the datagram
+    // The socket's thread copies each datagram into a pooled buffer and queues it, which is all
+    // record() does. A low priority thread writes the queue out through a large stdio buffer, so
+    // the network thread never waits on the SD card. Records that don't fit in the queue are dropped
+    // and counted rather than stalling the socket.
+    class Capture
+    {
+    public:
+        enum class Direction : uint8_t
+        {
+            RECEIVED = 0,
+            SENT = 1
+        };
+
+        static constexpr char MAGIC[8] = {'R', 'B', 'C', 'A', 'P', '\0', '\0', '\1'};
+        using RecordHeader = FixedLayout<uint8_t, int64_t, uint16_t>;
+        static_assert(RecordHeader::SIZE + MAX_PACKET_SIZE <= BufCache::MAX_BUF_SIZE, "A record of the largest datagram must fit in one buffer");
+
+        static constexpr size_t DEFAULT_QUEUE_DEPTH = 256;
+        static constexpr size_t FILE_BUFFER_SIZE = 64 * 1024;
+        static constexpr int PRIORITY = 32; // Below the main thread
+        static constexpr useconds_t IDLE_SLEEP_US = 5000;
+
+        struct Stats
+        {
+            size_t recorded = 0;
+            size_t dropped = 0; // Queue was full, or the datagram was over MAX_PACKET_SIZE
+            size_t bytesWritten = 0;
+        };
+
+    private:
+        SpscRing<FixedBuf> queue;
+        FILE *file = nullptr;
+        char *fileBuffer = nullptr;
+
+        Thread writer;
+        std::atomic_bool stopRequested = false;
+
+        // recorded and dropped belong to the recording thread, bytesWritten to the writer
+        Stats stats;
+
+        static void writeLoop(void *ctx)
+        {
+            Capture &self = *(Capture *)ctx;
+
+            while (true)
+            {
+                // Look at the flag before draining, so records queued before close() are all written
+                bool stopping = self.stopRequested.load(std::memory_order_acquire);
+
+                FixedBuf record;
+                bool wroteAny = false;
+                while (self.queue.pop(record))
+                {
+                    fwrite(record.data(), 1, record.size(), self.file);
+                    self.stats.bytesWritten += record.size();
+                    BufCache::recycle(std::move(record));
+                    wroteAny = true;
+                }
+
+                if (stopping)
+                {
+                    return;
+                }
+
+                if (!wroteAny)
+                {
+                    usleep(IDLE_SLEEP_US);
+                }
+            }
+        }
+
+        // Queue a record of len bytes, which copyFn(char *out) writes out
+        template <typename CopyFn>
+        void enqueue(Direction direction, size_t len, int64_t nowNs, CopyFn copyFn)
+        {
+            if (len > MAX_PACKET_SIZE)
+            {
+                stats.dropped++;
+                return;
+            }
+
+            FixedBuf buf = BufCache::getBuf(RecordHeader::SIZE + len);
+            char *out = buf.data();
+            RecordHeader::store(out, (uint8_t)direction, nowNs, (uint16_t)len);
+            copyFn(out);
+
+            if (!queue.push(std::move(buf)))
+            {
+                stats.dropped++;
+                BufCache::recycle(std::move(buf));
+                return;
+            }
+            stats.recorded++;
+        }
+
+    public:
+        explicit Capture(size_t queueDepth = DEFAULT_QUEUE_DEPTH) : queue(queueDepth) {}
+
+        Capture(const Capture&) = delete;
+        Capture& operator=(const Capture&) = delete;
+
+        // Start a new capture file, replacing any there was
+        bool open(const char *path)
+        {
+            close();
+
+            file = fopen(path, "wb");
+            if (file == nullptr)
+            {
+                LOG_ERROR("Cannot open capture file\n");
+                return false;
+            }
+
+            fileBuffer = new char[FILE_BUFFER_SIZE];
+            setvbuf(file, fileBuffer, _IOFBF, FILE_BUFFER_SIZE);
+            fwrite(MAGIC, 1, sizeof(MAGIC), file);
+            stats = Stats();
+            stats.bytesWritten = sizeof(MAGIC);
+
+            stopRequested = false;
+            if (!writer.start(&Capture::writeLoop, this, PRIORITY))
+            {
+                LOG_ERROR("Cannot start the capture writer\n");
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        bool isOpen() const
+        {
+            return file != nullptr;
+        }
+
+        // From the socket's thread only
+        void record(Direction direction, const char *data, size_t len, int64_t nowNs)
+        {
+            enqueue(direction, len, nowNs, [&](char *out) { memcpy(out, data, len); });
+        }
+
+        // From the socket's thread only, for a datagram sent in pieces
+        void record(Direction direction, const GatherBuf &datagram, int64_t nowNs)
+        {
+            enqueue(direction, datagram.size(), nowNs, [&](char *out) { datagram.copyTo(out); });
+        }
+
+        // Write out everything recorded so far and close the file
+        void close()
+        {
+            if (file == nullptr)
+            {
+                return;
+            }
+
+            stopRequested = true;
+            if (writer.joinable())
+            {
+                writer.join();
+            }
+
+            fclose(file);
+            file = nullptr;
+            delete[] fileBuffer;
+            fileBuffer = nullptr;
+
+            if (stats.dropped > 0)
+            {
+                LOG_WARN("Capture dropped %u records\n", (unsigned)stats.dropped);
+            }
+        }
+
+        // Only exact once close() has returned
+        const Stats &getStats() const
+        {
+            return stats;
+        }
+
+        ~Capture()
+        {
+            close();
+        }
+    };
+
+    // Reads a file written by Capture, one record at a time
+    class CaptureReader
+    {
+    public:
+        struct Record
+        {
+            Capture::Direction direction = Capture::Direction::RECEIVED;
+            int64_t timeNs = 0;
+            FixedBuf datagram;
+        };
+
+    private:
+        FILE *file = nullptr;
+
+    public:
+        CaptureReader() = default;
+        CaptureReader(const CaptureReader&) = delete;
+        CaptureReader& operator=(const CaptureReader&) = delete;
+
+        bool open(const char *path)
+        {
+            close();
+
+            file = fopen(path, "rb");
+            if (file == nullptr)
+            {
+                LOG_ERROR("Cannot open capture file\n");
+                return false;
+            }
+
+            char magic[sizeof(Capture::MAGIC)];
+            if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, Capture::MAGIC, sizeof(magic)) != 0)
+            {
+                LOG_ERROR("Not a capture file\n");
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        // Read the next record. Returns false at the end of the file, a truncated record, or one
+        // longer than any datagram Capture writes.
+        bool next(Record &record)
+        {
+            char header[Capture::RecordHeader::SIZE];
+            if (file == nullptr || fread(header, 1, sizeof(header), file) != sizeof(header))
+            {
+                return false;
+            }
+
+            uint8_t direction = 0;
+            uint16_t len = 0;
+            Capture::RecordHeader::load(header, direction, record.timeNs, len);
+            record.direction = (Capture::Direction)direction;
+
+            if (len > MAX_PACKET_SIZE)
+            {
+                LOG_ERROR("Capture record of %u bytes is too long\n", (unsigned)len);
+                return false;
+            }
+
+            record.datagram = BufCache::getBuf(len);
+            return fread(record.datagram.data(), 1, len, file) == len;
+        }
+
+        void close()
+        {
+            if (file != nullptr)
+            {
+                fclose(file);
+                file = nullptr;
+            }
+        }
+
+        ~CaptureReader()
+        {
+            close();
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_CAPTURE_H)
@@ -0,0 +1,111 @@
+#if !defined(LIBROBOCOL_EVENTLOOP_H)
+#define LIBROBOCOL_EVENTLOOP_H
+
+#include <array>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#include "clock.h"
+#include "SocketPool.h"
+
+namespace librobocol
+{
+    // Runs timed work between socket polls
+    // Every task has a deadline. Each pass blocks in SocketPool::tick() until the earliest deadline,
+    // or until a socket is ready, whichever is first, then runs the tasks that are due. With nothing
+    // due and nothing arriving the loop sleeps in the kernel instead of spinning.
+    class EventLoop
+    {
+    public:
+        // Run a task at nowNs. Returns the time it next needs to run.
+        using TaskFn = int64_t (*)(void *ctx, int64_t nowNs);
+
+        static constexpr size_t MAX_TASKS = 8;
+        static constexpr int64_t MAX_WAIT_NS = 1'000'000'000; // Wake at least this often regardless
+
+    private:
+        struct Task
+        {
+            TaskFn fn = nullptr;
+            void *ctx = nullptr;
+            int64_t deadlineNs = 0;
+        };
+
+        std::array<Task, MAX_TASKS> tasks;
+        size_t taskCount = 0;
+        bool stopped = false;
+
+    public:
+        // Add a task, first run at firstNs. Returns its id for wake().
+        size_t add(TaskFn fn, void *ctx, int64_t firstNs = 0)
+        {
+            assert(taskCount < MAX_TASKS);
+
+            tasks[taskCount] = {fn, ctx, firstNs};
+            return taskCount++;
+        }
+
+        // Run a task no later than atNs, for work that shows up between its deadlines
+        void wake(size_t id, int64_t atNs = 0)
+        {
+            assert(id < taskCount);
+
+            tasks[id].deadlineNs = std::min(tasks[id].deadlineNs, atNs);
+        }
+
+        int64_t nextDeadlineNs() const
+        {
+            int64_t next = INT64_MAX;
+            for (size_t i = 0; i < taskCount; i++)
+            {
+                next = std::min(next, tasks[i].deadlineNs);
+            }
+            return next;
+        }
+
+        // Milliseconds to block in the poll so we wake at or just after the next deadline
+        int pollTimeoutMs(int64_t nowNs) const
+        {
+            int64_t waitNs = std::min(nextDeadlineNs() - nowNs, MAX_WAIT_NS);
+            if (waitNs <= 0)
+            {
+                return 0;
+            }
+
+            return (int)((waitNs + 999'999) / 1'000'000);
+        }
+
+        // Wait for sockets or the next deadline, then run whatever is due
+        void runOnce()
+        {
+            SocketPool::tick(pollTimeoutMs(currentTimeNs()));
+
+            int64_t now = currentTimeNs();
+            for (size_t i = 0; i < taskCount; i++)
+            {
+                Task &task = tasks[i];
+                if (task.deadlineNs <= now)
+                {
+                    task.deadlineNs = task.fn(task.ctx, now);
+                }
+            }
+        }
+
+        void run()
+        {
+            stopped = false;
+            while (!stopped)
+            {
+                runOnce();
+            }
+        }
+
+        void stop()
+        {
+            stopped = true;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_EVENTLOOP_H)
@@ -1,7 +1,14 @@
 #if !defined(LIBROBOCOL_FIXEDBUF_H)
 #define LIBROBOCOL_FIXEDBUF_H
 
-#include <memory>
+#include <new>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <utility>
+
+#include "log.h"
 
 namespace librobocol
 {
@@ -20,7 +27,13 @@ namespace librobocol
 
         FixedBufItr(char* ptr = nullptr) { this->ptr = ptr;}
         FixedBufItr(const FixedBufItr& rawIterator) = default;
-        FixedBufItr(char* ptr, char* end) { this->ptr = ptr; this->end = end; }
+        FixedBufItr(char* ptr, char* end)
+        {
+            this->ptr = ptr;
+        #ifndef NDEBUG
+            this->end = end;
+        #endif
+        }
         ~FixedBufItr(){}
 
         FixedBufItr&                  operator=(const FixedBufItr& rawIterator) = default;
@@ -50,10 +63,12 @@ namespace librobocol
 
         char&                                 operator*()
         {
+        #ifndef NDEBUG
             if (ptr >= end)
             {
-                printf("VECTOR OVERRUN %p %p\n", ptr, end);
+                LOG_ERROR("VECTOR OVERRUN %p %p\n", (void *)ptr, (void *)end);
             }
+        #endif
             return *ptr;
         }
         //const char&                           operator*()const{return *ptr;}
@@ -72,134 +87,210 @@ namespace librobocol
     };
 
 
-    struct FixedBuf
+    // Header at the front of every buffer's allocation, followed by the buffer's bytes
+    // Aligned so the bytes after it start on an 8 byte boundary on the Wii as well.
+    struct alignas(8) BufHeader
     {
-        size_t len = 0;
-        std::shared_ptr<char[]> buf;
+        // Takes storage back when its last handle lets go, with refs reset to 1 for reuse
+        using ReleaseFn = void (*)(BufHeader *header);
 
-        FixedBuf(size_t len)
-        {
-            // assert((len & (len - 1)) == 0);
-            // assert(len > 0);
+        std::atomic<uint32_t> refs; // Handles to this storage
+        uint32_t cap; // Bytes after the header, which is what BufCache sorts buffers by
+        ReleaseFn owner; // Null for storage that is simply freed
 
-            printf("Making a fixedbuf of size %u\n", len);
+        BufHeader(uint32_t cap, ReleaseFn owner) : refs(1), cap(cap), owner(owner) {}
 
-            this->len = len;
-            //buf = std::make_unique_for_overwrite<char[]>(len);
-            buf = std::make_shared<char[]>(len);
+        char *bytes()
+        {
+            return (char *)(this + 1);
         }
 
-        FixedBuf(FixedBuf &&other)
+        static BufHeader *allocate(size_t cap, ReleaseFn owner)
         {
-            if (len != 0 || buf != nullptr) { printf("MOVING INTO A CONSTRUCTED OBJECT\n"); }
-
-            len = other.len;
-            buf = std::move(other.buf);
-
-            other.len = 0;
+            LOG_TRACE("Making a fixedbuf of size %u\n", (unsigned)cap);
+            return new (::operator new(sizeof(BufHeader) + cap)) BufHeader((uint32_t)cap, owner);
         }
-        FixedBuf &operator=(FixedBuf &&other)
+
+        static void free(BufHeader *header)
         {
-            if (len != 0 || buf != nullptr) { printf("MOVING INTO A CONSTRUCTED OBJECT\n"); }
-            len = other.len;
-            buf = std::move(other.buf);
+            header->~BufHeader();
+            ::operator delete(header);
+        }
+    };
 
-            other.len = 0;
+    // Move-only handle to a buffer, one pointer plus the length in use
+    // Moving a handle copies the pointer and touches nothing else. A handle that is the only one to
+    // its storage gives it back (to its pool, or the heap) without an atomic read-modify-write, so
+    // the usual life of a send or receive buffer costs no atomics at all. share() makes a second
+    // handle, for the few places that keep a datagram around (a parsed packet viewing its strings, a
+    // queue to another thread), and only then does the count come into play.
+    struct FixedBuf
+    {
+        size_t len = 0; // Bytes in use
 
-            return *this;
-        }
+    private:
+        BufHeader *header = nullptr;
 
-        /*FixedBuf(nullptr_t)
-        {
-            len = 0;
-            buf = nullptr;
-        }*/
+        explicit FixedBuf(BufHeader *header, size_t len) : len(len), header(header) {}
 
-        FixedBuf()
+        void drop()
         {
-            len = 0;
-            buf = nullptr;
+            // Sole owner, so nobody can be sharing it as we look
+            if (header->refs.load(std::memory_order_acquire) != 1)
+            {
+                if (header->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                {
+                    return;
+                }
+                header->refs.store(1, std::memory_order_relaxed);
+            }
+
+            if (header->owner != nullptr)
+            {
+                header->owner(header);
+            }
+            else
+            {
+                BufHeader::free(header);
+            }
         }
 
-        ~FixedBuf() 
+    public:
+        FixedBuf() = default;
+
+        FixedBuf(size_t len) : FixedBuf(len, len) {}
+
+        // Allocate cap bytes, of which the first len are in use. owner gets the storage back when
+        // the last handle to it goes.
+        FixedBuf(size_t len, size_t cap, BufHeader::ReleaseFn owner = nullptr) :
+            len(len), header(BufHeader::allocate(cap, owner))
+        {}
+
+        // A handle to storage handed back to a pool earlier, which must not be shared
+        static FixedBuf adopt(BufHeader *header, size_t len)
         {
-            if (len > 0 && buf != nullptr) {
-            printf("FREEING A FIXEDBUF\n");}
-        
+            assert(header->refs.load(std::memory_order_relaxed) == 1);
+            return FixedBuf(header, len);
         }
 
-        // todo: remove once our compiler gains the ability to put noncopyable types in vectors??
-        FixedBuf(const FixedBuf &other)
+        FixedBuf(FixedBuf &&other) noexcept : len(other.len), header(other.header)
         {
-            printf("Making a fixedbuf of size %u", len);
-            
-            this->len = other.len;
-            buf = other.buf;
+            other.len = 0;
+            other.header = nullptr;
+        }
 
-            /*if (other.isValid())
+        FixedBuf &operator=(FixedBuf &&other) noexcept
+        {
+            if (this != &other)
             {
-                memcpy(buf.get(), other.buf.get(), other.len);
-            }*/
+                reset();
+                len = other.len;
+                header = other.header;
+                other.len = 0;
+                other.header = nullptr;
+            }
+            return *this;
         }
-        FixedBuf &operator=(const FixedBuf &other)
-        {
-            printf("Making a fixedbuf of size %u", len);
 
-            this->len = other.len;
-            this->buf = other.buf;
-            /*buf = std::make_unique<char[]>(len);
+        // Copies would alias the same bytes without saying so. Use share() for that.
+        FixedBuf(const FixedBuf&) = delete;
+        FixedBuf &operator=(const FixedBuf&) = delete;
 
-            if (other.isValid())
+        ~FixedBuf()
+        {
+            reset();
+        }
+
+        // Let go of the storage, which goes back to its owner if this was the last handle
+        void reset()
+        {
+            if (header != nullptr)
             {
-                memcpy(buf.get(), other.buf.get(), other.len);
-            }*/
-            return *this;
+                drop();
+                header = nullptr;
+            }
+            len = 0;
         }
 
-        /*FixedBuf() = default;
+        // Another handle to the same storage, which stays alive until every handle is gone
+        FixedBuf share() const
+        {
+            if (header != nullptr)
+            {
+                header->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            return FixedBuf(header, len);
+        }
 
-        FixedBuf(const FixedBuf&) = delete;
-        FixedBuf& operator=(const FixedBuf&) = delete;
-        FixedBuf& operator=(FixedBuf&& other)
+        // Whether this is the only handle to its storage, so it can be written over or reused
+        bool unique() const noexcept
         {
-            len = other.len;
-            buf = std::move(other.buf);
-            return *this;
-        }*/
+            return header != nullptr && header->refs.load(std::memory_order_acquire) == 1;
+        }
 
         bool isValid() const noexcept
         {
-            return len != 0 && buf.get() != nullptr;
+            return len != 0 && header != nullptr;
+        }
+
+        size_t capacity() const noexcept
+        {
+            return header != nullptr ? header->cap : 0;
         }
 
         FixedBufItr begin()
         {
             #ifndef NDEBUG
-            return FixedBufItr(buf.get(), buf.get() + len);
+            return FixedBufItr(data(), data() + len);
             #else
-            return FixedBufItr(buf.get());
+            return FixedBufItr(data());
             #endif
         }
 
         FixedBufItr end()
         {
             #ifndef NDEBUG
-            return FixedBufItr(buf.get() + len, buf.get() + len);
+            return FixedBufItr(data() + len, data() + len);
             #else
-            return FixedBufItr(buf.get() + len);
+            return FixedBufItr(data() + len);
             #endif
         }
 
-        char *data()
+        char *data() const
         {
-            return buf.get();
+            return header != nullptr ? header->bytes() : nullptr;
         }
 
-        size_t size()
+        size_t size() const
         {
             return len;
         }
     };
+
+    // A FixedBuf whose copies share it, for packets that view strings in their datagram
+    // Packets are copied about like values (a command and its ack, say), and each copy needs the
+    // bytes its views point at to stay alive. Declaring a member this way is the opt-in.
+    struct SharedBuf : FixedBuf
+    {
+        SharedBuf() = default;
+        SharedBuf(FixedBuf &&buf) noexcept : FixedBuf(std::move(buf)) {}
+
+        SharedBuf(const SharedBuf &other) : FixedBuf(other.share()) {}
+        SharedBuf(SharedBuf &&other) noexcept = default;
+
+        SharedBuf &operator=(const SharedBuf &other)
+        {
+            FixedBuf::operator=(other.share());
+            return *this;
+        }
+        SharedBuf &operator=(SharedBuf &&other) noexcept = default;
+
+        SharedBuf &operator=(FixedBuf &&buf) noexcept
+        {
+            FixedBuf::operator=(std::move(buf));
+            return *this;
+        }
+    };
 }
 
 #endif // if !defined(LIBROBOCOL_FIXEDBUF_H)
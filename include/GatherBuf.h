@@ -0,0 +1,156 @@
+#if !defined(LIBROBOCOL_GATHERBUF_H)
+#define LIBROBOCOL_GATHERBUF_H
+
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <utility>
+
+#include "netcompat.h"
+#include "FixedBuf.h"
+#include "BufCache.h"
+
+namespace librobocol
+{
+    // A datagram to send, in pieces that are gathered together by the kernel as it goes out
+    // A packet with a large payload writes its fixed fields into head and adds views of the strings
+    // it already holds as further segments, keeping a share of their storage in payload until the
+    // send is done. The payload is then never copied on our side, which matters for commands and
+    // telemetry of several KiB. A datagram written whole is just head, as one segment.
+    struct GatherBuf
+    {
+        static constexpr size_t MAX_SEGMENTS = 8;
+
+        using Segment = net::Segment;
+
+        FixedBuf head; // Fixed fields, and the whole datagram if it wasn't gathered
+        FixedBuf payload; // Share of the storage the other segments view
+        Segment segments[MAX_SEGMENTS];
+        size_t count = 0;
+        size_t len = 0; // Bytes over all segments
+
+        GatherBuf() = default;
+
+        // A datagram already serialized into one buffer
+        GatherBuf(FixedBuf &&buf) : head(std::move(buf))
+        {
+            add(head.data(), head.size());
+        }
+
+        GatherBuf(GatherBuf &&other) noexcept :
+            head(std::move(other.head)), payload(std::move(other.payload)), count(other.count), len(other.len)
+        {
+            std::copy(other.segments, other.segments + count, segments);
+            other.count = 0;
+            other.len = 0;
+        }
+
+        GatherBuf &operator=(GatherBuf &&other) noexcept
+        {
+            if (this != &other)
+            {
+                head = std::move(other.head);
+                payload = std::move(other.payload);
+                count = other.count;
+                len = other.len;
+                std::copy(other.segments, other.segments + count, segments);
+                other.count = 0;
+                other.len = 0;
+            }
+            return *this;
+        }
+
+        GatherBuf(const GatherBuf&) = delete;
+        GatherBuf &operator=(const GatherBuf&) = delete;
+
+        // Room for size bytes of fixed fields, which are added as segments once written
+        char *allocHead(size_t size)
+        {
+            head = BufCache::getBuf(size);
+            return head.data();
+        }
+
+        // Append len bytes at data, which must live in head or payload
+        void add(const char *data, size_t len)
+        {
+            if (len == 0)
+            {
+                return;
+            }
+
+            // Pieces of head written one after another go out as one
+            if (count > 0 && segments[count - 1].data + segments[count - 1].len == data)
+            {
+                segments[count - 1].len += len;
+            }
+            else
+            {
+                assert(count < MAX_SEGMENTS);
+                segments[count++] = Segment{data, len};
+            }
+            this->len += len;
+        }
+
+        // Keep the storage the added views point into alive until the datagram is sent
+        void keep(const FixedBuf &storage)
+        {
+            payload = storage.share();
+        }
+
+        // Copy the segments out one after another, returning the end of what was written
+        char *copyTo(char *out) const
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                memcpy(out, segments[i].data, segments[i].len);
+                out += segments[i].len;
+            }
+            return out;
+        }
+
+        // Copy a gathered datagram into a single buffer, for sockets that can't send it in pieces
+        // Returns false, leaving it as it was, if it is too large for any buffer.
+        bool flatten()
+        {
+            if (count <= 1)
+            {
+                return true;
+            }
+
+            FixedBuf flat = BufCache::getBuf(len);
+            if (!flat.isValid())
+            {
+                return false;
+            }
+            copyTo(flat.data());
+
+            payload.reset();
+            head = std::move(flat);
+            count = 0;
+            len = 0;
+            add(head.data(), head.size());
+            return true;
+        }
+
+        // Let go of head and the payload's storage
+        void reset()
+        {
+            head.reset();
+            payload.reset();
+            count = 0;
+            len = 0;
+        }
+
+        bool isValid() const noexcept
+        {
+            return head.isValid();
+        }
+
+        size_t size() const
+        {
+            return len;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_GATHERBUF_H)
@@ -1,78 +1,92 @@
 #ifndef LIBROBOCOL_PACKETPROCESSOR_H
 #define LIBROBOCOL_PACKETPROCESSOR_H
 
-#include <memory>
 #include <array>
-#include <queue>
-#include <functional>
-#include <list>
+#include <concepts>
 
-#include "sync.h"
 #include "FixedBuf.h"
-#include "BufCache.h"
 
 
 // Do something with a packet of a type and provide it an environment of a type given by the template
-// This means the handlers can be global
-template <typename EnvT>
-class PacketHandler
+// This means the handlers can be global. A handler is a type with:
+//   static constexpr EnvT::MsgType TYPE; // The packet type it handles
+//   static size_t process(EnvT* env, FixedBuf &datagram); // May keep the datagram with share()
+template <typename HandlerT, typename EnvT>
+concept PacketHandler = requires(EnvT *env, librobocol::FixedBuf &datagram)
 {
-public:
-    virtual size_t process(EnvT* conn, const char *begin, const char *end) = 0;
-
-    virtual ~PacketHandler() = default;
+    { HandlerT::TYPE } -> std::convertible_to<typename EnvT::MsgType>;
+    { HandlerT::process(env, datagram) } -> std::convertible_to<size_t>;
 };
 
 // Sends completed packets to their handlers
-template <typename EnvT>
+// The handler list is fixed at compile time and becomes a table with one entry per message type, so
+// dispatching a datagram is a bounds check and one indexed call, with no virtual calls or std::function.
+template <typename EnvT, PacketHandler<EnvT>... HandlerTs>
 class PacketProcessor
 {
-    // Functors capable of handling each type of packet
-    std::vector<std::unique_ptr<PacketHandler<EnvT>>> handlers;
-
 public:
-    void addHandler(std::unique_ptr<PacketHandler<EnvT>> &&handler, EnvT::MsgType type)
-    {
-        /*if (type >= MsgType::COUNT || (int)type < 0)
-        {
-            throw std::out_of_range("Packet message type out of range")
-        }*/
+    using MsgType = typename EnvT::MsgType;
+    using HandlerFn = size_t (*)(EnvT *env, librobocol::FixedBuf &datagram);
 
-        if (handlers.size() <= (size_t)type)
-        {
-            handlers.resize((size_t)type + 1);
-        }
+    static constexpr size_t TYPE_COUNT = (size_t)MsgType::COUNT;
 
-        handlers.at((size_t)type) = std::move(handler);
+private:
+    static size_t skip(EnvT *env, librobocol::FixedBuf &datagram)
+    {
+        LOG_DEBUG("Skipping processing type %d\n", (int)datagram.data()[0]);
+        return 0;
     }
 
-    // Process a buffer of packets, which may contain more than one.
-    void process(EnvT* env, const char *begin, const char *end)
+    static constexpr std::array<HandlerFn, TYPE_COUNT> buildTable()
     {
-        printf("processing\n");
-        assert(end > begin);
-
-        typename EnvT::MsgType type = (typename EnvT::MsgType)env->peekType(begin, end);
+        std::array<HandlerFn, TYPE_COUNT> table{};
+        table.fill(&skip);
+        ((table[(size_t)HandlerTs::TYPE] = &HandlerTs::process), ...);
+        return table;
+    }
 
-        printf("processing type %d\n", (int)type);
+    static constexpr bool typesUnique()
+    {
+        size_t types[] = {(size_t)HandlerTs::TYPE..., TYPE_COUNT};
+        for (size_t i = 0; i < sizeof...(HandlerTs); i++)
+        {
+            for (size_t j = i + 1; j < sizeof...(HandlerTs); j++)
+            {
+                if (types[i] == types[j])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
 
+    static_assert((((size_t)HandlerTs::TYPE < TYPE_COUNT) && ...), "Handler type out of range");
+    static_assert(typesUnique(), "Two handlers for the same message type");
 
-        // printf("Message of type %d\n", type);
+public:
+    static constexpr std::array<HandlerFn, TYPE_COUNT> handlers = buildTable();
 
-        if ((size_t)type < handlers.size() && handlers[(size_t)type] != nullptr)
+    // Dispatch one datagram to the handler for its type. Empty datagrams come straight off the wire and are dropped.
+    static void process(EnvT* env, librobocol::FixedBuf &datagram)
+    {
+        if (datagram.size() == 0)
         {
-            handlers[(size_t)type]->process(env, begin, end);
+            return;
         }
-        else
+
+        size_t type = env->peekType(datagram.data(), datagram.data() + datagram.size());
+
+        if (type < TYPE_COUNT)
         {
-            printf("Skipping processing type %d\n", (int)type);
+            handlers[type](env, datagram);
         }
     }
 
-    size_t packetTypeCount()
+    static constexpr size_t packetTypeCount()
     {
-        return handlers.size();
+        return sizeof...(HandlerTs);
     }
 };
 
-#endif // ifndef LIBROBOCOL_PACKETPROCESSOR_H
\ No newline at end of file
+#endif // ifndef LIBROBOCOL_PACKETPROCESSOR_H
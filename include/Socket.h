@@ -1,6 +1,9 @@
 #if !defined(LIBROBOCOL_SOCKET_H)
 #define LIBROBOCOL_SOCKET_H
 
+#include <atomic>
+#include <compare>
+
 #include "FixedBuf.h"
 
 namespace librobocol
@@ -20,7 +23,8 @@ namespace librobocol
         virtual InterfaceType getInterfaceType() const noexcept = 0;
 
         // Put a packet on the socket to be output later
-        virtual void write(FixedBuf &&buf) = 0;
+        // Returns false if it could not be queued
+        virtual bool write(FixedBuf &&buf) = 0;
     };
 
     class LibogcNetSocket : public Socket
@@ -29,6 +33,10 @@ namespace librobocol
 
         InterfaceType getInterfaceType() const noexcept { return InterfaceType::LIBOGC_NET; } 
 
+        // Whether SocketPool should poll for POLLOUT. Set from any thread by SocketPool::setWriteInterest()
+        // and copied into the poll set by SocketPool::tick() before each net_poll.
+        std::atomic_bool wantWrite = true;
+
         // Get the underlying socket handle
         virtual int getSocketHandle() const noexcept = 0;
 
@@ -45,6 +53,37 @@ namespace librobocol
             return getSocketHandle() == lhs.getSocketHandle();
         }
     };
+
+    // Berkeley sockets on a Linux host, polled by SocketPool through epoll
+    class PosixSocket : public Socket
+    {
+        public:
+
+        InterfaceType getInterfaceType() const noexcept { return InterfaceType::POSIX; } 
+
+        // Get the underlying file descriptor
+        virtual int getSocketHandle() const noexcept = 0;
+
+        // Tell the socket what new operations are available, as POLLIN/POLLOUT/POLLERR bits
+        virtual void handlePollResult(int res) = 0;
+
+        std::strong_ordering operator<=> (const PosixSocket& lhs) const
+        {
+            return getSocketHandle() <=> lhs.getSocketHandle();
+        }
+
+        bool operator== (const PosixSocket& lhs) const 
+        {
+            return getSocketHandle() == lhs.getSocketHandle();
+        }
+    };
+
+    // The socket interface SocketPool drives on this platform
+#ifdef GEKKO
+    using NativeSocket = LibogcNetSocket;
+#else
+    using NativeSocket = PosixSocket;
+#endif
 }
 
 #endif // if !defined(LIBROBOCOL_SOCKET_H)
\ No newline at end of file
@@ -5,66 +5,260 @@
 #include <algorithm>
 #include <variant>
 #include <cassert>
+#include <cstdio>
 
-#include <network.h>
+#include "netcompat.h"
+
+#ifndef GEKKO
+#include <sys/epoll.h>
+#endif
 
-#include "sync.h"
 #include "Socket.h"
 
 namespace librobocol
 {
-    // Class that pools libogc net sockets to poll them all at once
-    // Cannot be applicable to all files since the net_ function prefix does not apply to the filesystem
+    // Class that pools sockets to poll them all at once
+    // On libogc this is a net_poll over every socket. On POSIX it is an epoll set, so a tick only
+    // touches the sockets that actually have events ready.
+    // The pool belongs to whichever thread runs tick(), and add() and remove() must be called from
+    // that thread, or while no thread is in tick(). It takes no lock: tick() blocks in the poll,
+    // and a handler it calls may add or remove a socket. A socket removed during tick() gets no more
+    // events from that tick: libogc's entry is marked and dropped once the handlers have run, and
+    // POSIX's pending events for it are cleared. NetworkThread sets its sockets up before start()
+    // and takes them down after stop().
+    // setWriteInterest() is the exception, and may be called from any thread. On libogc it only
+    // stores a flag on the socket, which tick() applies to the poll set before polling; on POSIX it
+    // is an epoll_ctl, which the kernel orders against a concurrent epoll_wait.
     class SocketPool
     {
     public:
-        static Mutex accessM;
-        static std::vector<std::reference_wrapper<LibogcNetSocket>> sockets;
-        static std::vector<pollsd> polls;
+        static std::vector<std::reference_wrapper<NativeSocket>> sockets;
+
+#ifdef GEKKO
+        static std::vector<pollsd> polls; // A socket of REMOVED marks an entry remove() took out during tick()
+        static constexpr s32 REMOVED = -1;
+        static bool ticking;
+        static bool compactPending;
+#else
+        static constexpr int MAX_EVENTS = 64;
+
+        static int epollFd;
+        static epoll_event events[MAX_EVENTS];
+        static int eventCount; // Events tick() has yet to hand out, which remove() clears a socket's from
+#endif
+
+    private:
+        // Where a socket is in sockets, by identity, since a removed entry's socket may be gone
+        static size_t indexOf(const NativeSocket &sock)
+        {
+            for (size_t i = 0; i < sockets.size(); i++)
+            {
+#ifdef GEKKO
+                if (polls[i].socket == REMOVED)
+                {
+                    continue;
+                }
+#endif
+                if (&sockets[i].get() == &sock)
+                {
+                    return i;
+                }
+            }
+            return sockets.size();
+        }
 
-        // libogc net_ sockets
+#ifdef GEKKO
+        // Drop the entries remove() marked while tick() was handing out events
+        static void compact()
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < polls.size(); i++)
+            {
+                if (polls[i].socket != REMOVED)
+                {
+                    sockets[kept] = sockets[i];
+                    polls[kept] = polls[i];
+                    kept++;
+                }
+            }
+            sockets.erase(sockets.begin() + kept, sockets.end());
+            polls.resize(kept);
+            compactPending = false;
+        }
+#endif
+
+    public:
         template <typename SockT>
-        typename std::enable_if_t<std::is_base_of_v<LibogcNetSocket, SockT>>
+        typename std::enable_if_t<std::is_base_of_v<NativeSocket, SockT>>
         static add(SockT &sock)
         {
-            auto l = LockGuardMutex(accessM);
+            if (indexOf(sock) != sockets.size())
+            {
+                return;
+            }
+
+#ifdef GEKKO
+            sockets.push_back(sock);
+            polls.push_back({.socket = sock.getSocketHandle(), .events = POLLIN | POLLOUT, .revents = 0});
+#else
+            if (epollFd < 0 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            {
+                perror("epoll_create1");
+                return;
+            }
+
+            // Sockets drop POLLOUT the first time they find nothing to send, see setWriteInterest()
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.ptr = (NativeSocket*)&sock;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock.getSocketHandle(), &ev) < 0)
+            {
+                perror("epoll_ctl add");
+                return;
+            }
+
+            sockets.push_back(sock);
+#endif
+        }
+
+        template <typename SockT>
+        typename std::enable_if_t<std::is_base_of_v<NativeSocket, SockT>>
+        static remove(SockT &sock)
+        {
+            size_t index = indexOf(sock);
+            if (index == sockets.size())
+            {
+                return;
+            }
 
-            if (std::find(sockets.begin(), sockets.end(), (LibogcNetSocket&)sock) == sockets.end())
+#ifdef GEKKO
+            // Erasing would shift the entries tick() has yet to get to
+            if (ticking)
             {
-                sockets.push_back(sock);
-                polls.push_back({.socket = sock.getSocketHandle(), .events = POLLIN | POLLOUT, .revents = 0});
+                polls[index].socket = REMOVED;
+                compactPending = true;
+                return;
             }
+            polls.erase(polls.begin() + index);
+#else
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, sock.getSocketHandle(), nullptr);
+
+            // A handler called by tick() may remove (and destroy) a socket later in the same batch
+            for (int i = 0; i < eventCount; i++)
+            {
+                if (events[i].data.ptr == (NativeSocket*)&sock)
+                {
+                    events[i].data.ptr = nullptr;
+                }
+            }
+#endif
+            sockets.erase(sockets.begin() + index);
         }
 
-        static void tick()
+        // Ask to be woken when the socket is writable. A UDP socket is nearly always writable, so
+        // waiting on it while nothing is queued would make every tick touch every socket and keep
+        // a blocking tick from ever sleeping.
+        // Called from tick() by a socket's handler, and by the producer side of UdpSocket::write(),
+        // which may be another thread. A producer that arms a socket while tick() is blocked must
+        // wake it (NetworkThread does, through its Waker) for libogc to start polling for POLLOUT.
+        static void setWriteInterest(NativeSocket &sock, bool wantWrite)
         {
-            auto l = LockGuardMutex(accessM);
+#ifdef GEKKO
+            // Otherwise net_poll returns straight away for a writable socket and the loop can never block
+            sock.wantWrite.store(wantWrite, std::memory_order_release);
+#else
+            if (epollFd < 0)
+            {
+                return;
+            }
+
+            epoll_event ev = {};
+            ev.events = EPOLLIN | (wantWrite ? EPOLLOUT : 0);
+            ev.data.ptr = &sock;
+            if (epoll_ctl(epollFd, EPOLL_CTL_MOD, sock.getSocketHandle(), &ev) < 0)
+            {
+                perror("epoll_ctl mod");
+            }
+#endif
+        }
 
+        // Poll every socket, waiting up to timeoutMs for one to become ready
+        static void tick(int timeoutMs = 0)
+        {
+#ifdef GEKKO
             assert(sockets.size() == polls.size());
 
             if (polls.size() > 0)
             {
-                int res = net_poll(polls.data(), polls.size(), 0);
+                for (size_t i = 0; i < polls.size(); i++)
+                {
+                    bool wantWrite = sockets[i].get().wantWrite.load(std::memory_order_acquire);
+                    polls[i].events = POLLIN | (wantWrite ? POLLOUT : 0);
+                }
+
+                int res = net_poll(polls.data(), polls.size(), timeoutMs);
 
                 if (res < 0)
                 {
                     perror("Sock poll error");
                 }
 
+                // A handler may add sockets, which go on the end, or remove them, which only marks them
+                ticking = true;
                 for (size_t i = 0; i < polls.size(); i++)
                 {
-                    pollsd &poll = polls[i];
-                    LibogcNetSocket &sock = sockets[i];
+                    if (polls[i].socket == REMOVED)
+                    {
+                        continue;
+                    }
 
-                    sock.handlePollResult(poll.revents);
+                    int revents = polls[i].revents;
+                    NativeSocket &sock = sockets[i];
+
+                    sock.handlePollResult(revents);
                 }
+                ticking = false;
 
+                if (compactPending)
+                {
+                    compact();
+                }
                 reset();
             }
+#else
+            if (epollFd < 0)
+            {
+                return;
+            }
 
-            
+            int res = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+
+            if (res < 0)
+            {
+                if (errno != EINTR)
+                {
+                    perror("Sock poll error");
+                }
+                return;
+            }
+
+            eventCount = res;
+            for (int i = 0; i < res; i++)
+            {
+                // Removed by an earlier handler in this batch
+                if (events[i].data.ptr == nullptr)
+                {
+                    continue;
+                }
+
+                NativeSocket &sock = *(NativeSocket*)events[i].data.ptr;
+                sock.handlePollResult(toPollEvents(events[i].events));
+            }
+            eventCount = 0;
+#endif
         }
 
+#ifdef GEKKO
         static void reset()
         {
             for (auto &i : polls)
@@ -72,10 +266,28 @@ namespace librobocol
                 i.revents = POLLNVAL;
             }
         }
+#else
+        static int toPollEvents(uint32_t epollEvents)
+        {
+            int res = 0;
+            if (epollEvents & EPOLLIN) { res |= POLLIN; }
+            if (epollEvents & EPOLLOUT) { res |= POLLOUT; }
+            if (epollEvents & EPOLLERR) { res |= POLLERR; }
+            if (epollEvents & EPOLLHUP) { res |= POLLHUP; }
+            return res;
+        }
+#endif
     };
-    Mutex SocketPool::accessM = {};
-    std::vector<std::reference_wrapper<LibogcNetSocket>> SocketPool::sockets = {};
+    std::vector<std::reference_wrapper<NativeSocket>> SocketPool::sockets = {};
+#ifdef GEKKO
     std::vector<pollsd> SocketPool::polls;
+    bool SocketPool::ticking = false;
+    bool SocketPool::compactPending = false;
+#else
+    int SocketPool::epollFd = -1;
+    epoll_event SocketPool::events[SocketPool::MAX_EVENTS];
+    int SocketPool::eventCount = 0;
+#endif
 }
 
-#endif // if !defined(LIBROBOCOL_SOCKETPOOL_H)
\ No newline at end of file
+#endif // if !defined(LIBROBOCOL_SOCKETPOOL_H)
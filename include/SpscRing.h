@@ -0,0 +1,131 @@
+#if !defined(LIBROBOCOL_SPSCRING_H)
+#define LIBROBOCOL_SPSCRING_H
+
+#include <atomic>
+#include <memory>
+#include <cassert>
+#include <bit>
+
+namespace librobocol
+{
+#ifdef GEKKO
+    constexpr size_t CACHE_LINE_SIZE = 32; // Broadway/Gekko L1 line
+#else
+    constexpr size_t CACHE_LINE_SIZE = 64;
+#endif
+
+    // Bounded lock-free queue for exactly one producer thread and one consumer thread
+    // Head and tail live on their own cache lines, and each side keeps a cached copy of the other's
+    // index so it only reads the shared one when the ring looks full or empty.
+    template <typename T>
+    class SpscRing
+    {
+        // Written by the producer
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> head = 0;
+        size_t cachedTail = 0;
+
+        // Written by the consumer
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail = 0;
+        size_t cachedHead = 0;
+
+        alignas(CACHE_LINE_SIZE) size_t mask = 0;
+        std::unique_ptr<T[]> slots;
+
+    public:
+        // Capacity is rounded up to a power of two
+        explicit SpscRing(size_t capacity)
+        {
+            assert(capacity > 0);
+
+            capacity = std::bit_ceil(capacity);
+            mask = capacity - 1;
+            slots = std::make_unique<T[]>(capacity);
+        }
+
+        SpscRing(const SpscRing&) = delete;
+        SpscRing& operator=(const SpscRing&) = delete;
+
+        // Producer only. Returns false and leaves val alone if the ring is full.
+        bool push(T &&val)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+
+            if (h - cachedTail > mask)
+            {
+                cachedTail = tail.load(std::memory_order_acquire);
+                if (h - cachedTail > mask)
+                {
+                    return false;
+                }
+            }
+
+            slots[h & mask] = std::move(val);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer only. Returns false if the ring is empty.
+        bool pop(T &out)
+        {
+            T *val = front();
+            if (val == nullptr)
+            {
+                return false;
+            }
+
+            out = std::move(*val);
+            discard(1);
+            return true;
+        }
+
+        // Consumer only. The i'th queued element without removing it, or null if there are not that many.
+        T *peek(size_t i)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+
+            if (cachedHead - t <= i)
+            {
+                cachedHead = head.load(std::memory_order_acquire);
+                if (cachedHead - t <= i)
+                {
+                    return nullptr;
+                }
+            }
+
+            return &slots[(t + i) & mask];
+        }
+
+        T *front()
+        {
+            return peek(0);
+        }
+
+        // Consumer only. Remove n elements that were checked with peek().
+        void discard(size_t n)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            assert(cachedHead - t >= n);
+
+            tail.store(t + n, std::memory_order_release);
+        }
+
+        bool empty() const
+        {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        size_t size() const
+        {
+            // Tail first, so a push racing in between can't make it look larger than head
+            size_t t = tail.load(std::memory_order_acquire);
+            return head.load(std::memory_order_acquire) - t;
+        }
+
+        size_t capacity() const
+        {
+            return mask + 1;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_SPSCRING_H)
@@ -0,0 +1,94 @@
+#if !defined(LIBROBOCOL_THREAD_H)
+#define LIBROBOCOL_THREAD_H
+
+#include <cassert>
+
+#ifdef GEKKO
+#include <ogc/lwp.h>
+#else
+#include <thread>
+#endif
+
+namespace librobocol
+{
+    // A joinable thread running a plain function, as an LWP on libogc and a std::thread elsewhere
+    class Thread
+    {
+    public:
+        using EntryFn = void (*)(void *ctx);
+
+        // LWP priorities run from 0 to 127 and the main thread starts at 64. Ignored off the Wii.
+        static constexpr int PRIORITY_DEFAULT = 64;
+        static constexpr size_t STACK_SIZE_DEFAULT = 64 * 1024;
+
+    private:
+        EntryFn entry = nullptr;
+        void *ctx = nullptr;
+
+#ifdef GEKKO
+        lwp_t handle = LWP_THREAD_NULL;
+
+        static void *trampoline(void *arg)
+        {
+            Thread &thread = *(Thread *)arg;
+            thread.entry(thread.ctx);
+            return nullptr;
+        }
+#else
+        std::thread handle;
+#endif
+
+    public:
+        Thread() = default;
+        Thread(const Thread&) = delete;
+        Thread& operator=(const Thread&) = delete;
+
+        bool start(EntryFn entry, void *ctx, int priority = PRIORITY_DEFAULT, size_t stackSize = STACK_SIZE_DEFAULT)
+        {
+            assert(!joinable());
+
+            this->entry = entry;
+            this->ctx = ctx;
+
+#ifdef GEKKO
+            return LWP_CreateThread(&handle, &Thread::trampoline, this, nullptr, stackSize, priority) >= 0;
+#else
+            (void)priority;
+            (void)stackSize;
+            handle = std::thread(entry, ctx);
+            return true;
+#endif
+        }
+
+        bool joinable() const
+        {
+#ifdef GEKKO
+            return handle != LWP_THREAD_NULL;
+#else
+            return handle.joinable();
+#endif
+        }
+
+        void join()
+        {
+            if (!joinable())
+            {
+                return;
+            }
+
+#ifdef GEKKO
+            LWP_JoinThread(handle, nullptr);
+            handle = LWP_THREAD_NULL;
+#else
+            handle.join();
+#endif
+        }
+
+        ~Thread()
+        {
+            join();
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_THREAD_H)
@@ -0,0 +1,322 @@
+#if !defined(LIBROBOCOL_TIMERWHEEL_H)
+#define LIBROBOCOL_TIMERWHEEL_H
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+namespace librobocol
+{
+    // A timer that lives inside whatever owns it, so scheduling one never allocates
+    // Cancel a scheduled timer before destroying it. The destructor only unlinks it, which keeps the
+    // wheel safe but leaves its count high.
+    struct Timer
+    {
+        using Fn = void (*)(void *ctx, int64_t nowNs);
+
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        int64_t expiresNs = 0;
+        uint16_t slot = 0; // Which wheel slot holds it, while scheduled
+
+        Fn fn = nullptr;
+        void *ctx = nullptr;
+
+        Timer() = default;
+        Timer(Fn fn, void *ctx) : fn(fn), ctx(ctx) {}
+
+        // Timers link to each other, so they can't be copied while scheduled
+        Timer(const Timer &other) : fn(other.fn), ctx(other.ctx) {}
+        Timer &operator=(const Timer &other)
+        {
+            assert(!scheduled());
+            fn = other.fn;
+            ctx = other.ctx;
+            return *this;
+        }
+
+        bool scheduled() const
+        {
+            return next != nullptr;
+        }
+
+        void unlink()
+        {
+            if (scheduled())
+            {
+                prev->next = next;
+                next->prev = prev;
+                prev = next = nullptr;
+            }
+        }
+
+        ~Timer()
+        {
+            unlink();
+        }
+    };
+
+    // Hierarchical timing wheel
+    // LEVELS wheels of SLOTS slots each. A level 0 slot is one TICK_NS tick, and each slot of a higher
+    // level spans a whole turn of the level below it. A timer goes in the lowest level whose turn
+    // reaches its expiry, so scheduling and cancelling are a list insert and unlink wherever it lands.
+    // When a lower level wraps, the next slot of the level above is emptied back down into it, so each
+    // timer is moved at most LEVELS - 1 times however far out it was set. A bitmap per level says
+    // which slots hold anything, so advancing over empty ticks and finding the next expiry don't walk
+    // the slots, and pending timers cost nothing until their slot comes up.
+    class TimerWheel
+    {
+    public:
+        static constexpr int64_t TICK_NS = 1'000'000;
+        static constexpr int LEVEL_BITS = 6;
+        static constexpr size_t SLOTS = 1 << LEVEL_BITS;
+        static constexpr int LEVELS = 4; // Covers 2^24 ticks, about 4.6 hours at 1ms
+
+    private:
+        static constexpr int64_t SLOT_MASK = SLOTS - 1;
+        static constexpr int64_t MAX_SPAN = 1LL << (LEVEL_BITS * LEVELS);
+
+        struct Level
+        {
+            std::array<Timer, SLOTS> heads; // List heads, linked to themselves when empty
+            uint64_t occupied = 0; // Bit per non-empty slot
+        };
+
+        std::array<Level, LEVELS> levels;
+        int64_t currentTick = 0; // Next tick to run, every one before it has been run
+        size_t count = 0;
+
+        // Ticks round up, so a timer never runs before its expiry
+        static int64_t tickOf(int64_t ns)
+        {
+            return ns / TICK_NS + (ns % TICK_NS > 0);
+        }
+
+        static int shiftFor(int level)
+        {
+            return level * LEVEL_BITS;
+        }
+
+        static bool isEmpty(const Timer &head)
+        {
+            return head.next == &head;
+        }
+
+        // Link a timer into the slot for its expiry, relative to currentTick
+        void place(Timer &timer)
+        {
+            int64_t tick = std::max(tickOf(timer.expiresNs), currentTick);
+            int64_t delta = tick - currentTick;
+
+            // Too far out for the top level, so park it at the far edge and place it again from there
+            if (delta >= MAX_SPAN)
+            {
+                tick = currentTick + MAX_SPAN - 1;
+                delta = MAX_SPAN - 1;
+            }
+
+            int level = 0;
+            while (level < LEVELS - 1 && delta >= (int64_t)SLOTS << shiftFor(level))
+            {
+                level++;
+            }
+
+            size_t index = (tick >> shiftFor(level)) & SLOT_MASK;
+            Level &wheel = levels[level];
+            Timer &head = wheel.heads[index];
+
+            timer.slot = (uint16_t)(level * SLOTS + index);
+            timer.prev = head.prev;
+            timer.next = &head;
+            head.prev->next = &timer;
+            head.prev = &timer;
+            wheel.occupied |= 1ULL << index;
+        }
+
+        // Take every timer out of a slot onto a local list
+        static void detach(Level &wheel, size_t index, Timer &into)
+        {
+            Timer &head = wheel.heads[index];
+            wheel.occupied &= ~(1ULL << index);
+
+            if (isEmpty(head))
+            {
+                into.prev = into.next = &into;
+                return;
+            }
+
+            into.next = head.next;
+            into.prev = head.prev;
+            into.next->prev = &into;
+            into.prev->next = &into;
+            head.prev = head.next = &head;
+        }
+
+        // Move a higher level slot's timers down, now that the level below has wrapped onto it
+        void cascade(int level)
+        {
+            Timer pending;
+            detach(levels[level], (currentTick >> shiftFor(level)) & SLOT_MASK, pending);
+
+            while (!isEmpty(pending))
+            {
+                Timer &timer = *pending.next;
+                timer.unlink();
+                place(timer);
+            }
+            pending.prev = pending.next = nullptr;
+        }
+
+        // Run the timers in level 0's slot for currentTick and move on to the next tick
+        void runTick(int64_t nowNs)
+        {
+            // Detach the slot first, so a timer rescheduled for now goes in the next tick rather than
+            // a slot that won't come round again for a whole turn
+            Timer pending;
+            detach(levels[0], currentTick & SLOT_MASK, pending);
+            currentTick++;
+
+            while (!isEmpty(pending))
+            {
+                Timer &timer = *pending.next;
+                timer.unlink();
+                count--;
+                timer.fn(timer.ctx, nowNs);
+            }
+            pending.prev = pending.next = nullptr;
+        }
+
+        // Ticks from currentTick to the next occupied level 0 slot, or SLOTS if there is none
+        int64_t ticksToNextDue() const
+        {
+            uint64_t bits = levels[0].occupied;
+            if (bits == 0)
+            {
+                return SLOTS;
+            }
+            return std::countr_zero(std::rotr(bits, (int)(currentTick & SLOT_MASK)));
+        }
+
+    public:
+        explicit TimerWheel(int64_t nowNs = 0)
+        {
+            for (Level &wheel : levels)
+            {
+                for (Timer &head : wheel.heads)
+                {
+                    head.prev = head.next = &head;
+                }
+            }
+            currentTick = nowNs / TICK_NS;
+        }
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        // Run timer.fn at or shortly after expiresNs, replacing any time it was already set for
+        void schedule(Timer &timer, int64_t expiresNs)
+        {
+            cancel(timer);
+
+            timer.expiresNs = expiresNs;
+            place(timer);
+            count++;
+        }
+
+        void cancel(Timer &timer)
+        {
+            if (!timer.scheduled())
+            {
+                return;
+            }
+
+            Level &wheel = levels[timer.slot / SLOTS];
+            size_t index = timer.slot & SLOT_MASK;
+
+            timer.unlink();
+            if (isEmpty(wheel.heads[index]))
+            {
+                wheel.occupied &= ~(1ULL << index);
+            }
+            count--;
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        // Run every timer that has expired by nowNs. A timer is unlinked before it runs, so it can
+        // schedule itself again.
+        void advance(int64_t nowNs)
+        {
+            int64_t targetTick = nowNs / TICK_NS;
+
+            while (currentTick <= targetTick)
+            {
+                if (count == 0)
+                {
+                    currentTick = targetTick + 1;
+                    break;
+                }
+
+                // Level 0 wrapped, so bring down the next slot of each level that wrapped with it
+                if ((currentTick & SLOT_MASK) == 0)
+                {
+                    for (int level = 1; level < LEVELS; level++)
+                    {
+                        cascade(level);
+                        if (((currentTick >> shiftFor(level)) & SLOT_MASK) != 0)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                runTick(nowNs);
+
+                // Nothing happens before the next expiry or cascade, so skip the ticks in between
+                currentTick = std::min(std::max(currentTick, nextExpiryNs() / TICK_NS), targetTick + 1);
+            }
+        }
+
+        // When advance() next has work to do, or INT64_MAX if nothing is scheduled
+        // This is the earliest expiry in level 0, or the time a higher level slot is due to cascade if
+        // that comes first, which at worst wakes the caller early for a pass that runs nothing.
+        int64_t nextExpiryNs() const
+        {
+            if (count == 0)
+            {
+                return INT64_MAX;
+            }
+
+            int64_t earliestTick = INT64_MAX;
+            if (levels[0].occupied != 0)
+            {
+                earliestTick = currentTick + ticksToNextDue();
+            }
+
+            for (int level = 1; level < LEVELS; level++)
+            {
+                uint64_t bits = levels[level].occupied;
+                if (bits == 0)
+                {
+                    continue;
+                }
+
+                // The slot at the current position has cascaded already, unless currentTick is the
+                // boundary it cascades on and hasn't run yet
+                int64_t position = currentTick >> shiftFor(level);
+                int64_t first = (currentTick & ((1LL << shiftFor(level)) - 1)) == 0 ? position : position + 1;
+                int distance = std::countr_zero(std::rotr(bits, (int)(first & SLOT_MASK)));
+                earliestTick = std::min(earliestTick, (first + distance) << shiftFor(level));
+            }
+
+            return earliestTick * TICK_NS;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_TIMERWHEEL_H)
@@ -1,19 +1,24 @@
 #if !defined(LIBROBOCOL_UDPSOCKET_H)
 #define LIBROBOCOL_UDPSOCKET_H
 
-#include <deque>
-#include <network.h>
+#include <atomic>
 
+#include "netcompat.h"
 #include "sync.h"
 #include "FixedBuf.h"
 #include "BufCache.h"
+#include "GatherBuf.h"
 #include "Socket.h"
+#include "SocketPool.h"
+#include "SpscRing.h"
 #include "PacketProcessor.h"
+#include "Capture.h"
+#include "clock.h"
 
 
 namespace librobocol
 {
-    class UdpSocket : public LibogcNetSocket
+    class UdpSocket : public NativeSocket
     {
     public:
         int native = 0;
@@ -21,150 +26,299 @@ namespace librobocol
         sockaddr_in targetAddr = {};
         sockaddr_in bindAddr = {};
 
-        std::deque<FixedBuf> writeQueue;
-        Mutex writeQueueMutex;
-
-        std::unique_ptr<char[]> readBuf;
-        size_t readBufSize = 66000;
-
-        std::function<void(char*, char*)> processor;
+        // What write() does when the write queue is full
+        enum class WritePolicy
+        {
+            DROP_NEWEST, // Recycle the incoming buffer and count it in droppedWrites
+            REJECT // Leave the buffer with the caller, who can retry or drop it themselves
+        };
+
+        static constexpr size_t DEFAULT_WRITE_QUEUE_DEPTH = 64;
+
+        // Local port to bind. Robocol peers reply to the port they were sent from, so by default it
+        // is the remote port. 0 lets the kernel pick one, for a second peer on the same host.
+        static constexpr int SAME_PORT = -1;
+        static constexpr int EPHEMERAL_PORT = 0;
+
+        // One producer (whoever sends packets) and one consumer (SocketPool::tick)
+        // Datagrams can be queued in pieces, which go out with one sendmsg each.
+        SpscRing<GatherBuf> writeQueue;
+        WritePolicy writePolicy = WritePolicy::DROP_NEWEST;
+        std::atomic_bool writeArmed = true; // SocketPool::add() starts out waiting for POLLOUT
+        std::atomic_size_t droppedWrites = 0;
+
+        // Datagrams taken per syscall. libogc has no recvmmsg/sendmmsg, so it goes one at a time.
+#ifdef GEKKO
+        static constexpr size_t RECV_BATCH = 1;
+#else
+        static constexpr size_t RECV_BATCH = 8;
+#endif
+        static constexpr size_t SEND_BATCH = 16;
+        static constexpr size_t DEFAULT_IO_BUDGET = 32;
+
+        // Most datagrams read, and most sent, in one handlePollResult() so one socket can't starve the loop
+        size_t ioBudget = DEFAULT_IO_BUDGET;
+
+        // Datagrams are read straight into pooled buffers that are handed to the processor. If it
+        // keeps a share of one (to view strings in it, say), the slot gets a fresh buffer and the
+        // old one lives on with the packet, so any number of datagrams can be in flight.
+        static constexpr size_t READ_BUF_SIZE = MAX_PACKET_SIZE;
+        FixedBuf readBufs[RECV_BATCH];
+
+        // Called with each received datagram. A plain function and context pointer rather than a
+        // std::function, so a receive costs one direct call through a pointer.
+        using ReceiveFn = void (*)(void *ctx, FixedBuf &datagram);
+        ReceiveFn processor = nullptr;
+        void *processorCtx = nullptr;
+
+        // Records every datagram read and sent when set. Set it before the socket is polled.
+        Capture *capture = nullptr;
 
         // Unconnected socket
-        UdpSocket()
-        {
-            readBuf = std::make_unique<char[]>(66000);
-        }
+        UdpSocket() : writeQueue(DEFAULT_WRITE_QUEUE_DEPTH) {}
 
         // Create a UDP client socket listening on all interfaces
-        UdpSocket(int port, const char *targetIp, std::function<void(char*, char*)> processorFunc)
+        UdpSocket(int port, const char *targetIp, ReceiveFn processorFunc, void *processorCtx, int localPort = SAME_PORT,
+            size_t writeQueueDepth = DEFAULT_WRITE_QUEUE_DEPTH, WritePolicy policy = WritePolicy::DROP_NEWEST) :
+            writeQueue(writeQueueDepth), writePolicy(policy)
         {
             int ret = -999;
 
             processor = processorFunc;
-
-            readBuf = std::make_unique<char[]>(66000);
-
-            printf("Opening a socket on %s:%d", targetIp, port);
+            this->processorCtx = processorCtx;
 
             // Robot IP
-            targetAddr = {.sin_len = sizeof(targetAddr), .sin_family = AF_INET, .sin_port = (u16)htons(port)};
-            if ((targetAddr.sin_addr.s_addr = inet_addr(targetIp)) == 0)
+            if (!net::makeAddr(targetAddr, targetIp, port))
             {
-                fprintf(stderr, "inet_aton() failed\n");
+                LOG_ERROR("inet_aton() failed\n");
             }
 
-            // Match all IPs on port (0.0.0.0)
-            //bindAddr = {.sin_len = sizeof(bindAddr), .sin_family = AF_INET, .sin_port = (u16)htons(port)};
-            //bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-            //bindAddr.sin_addr.s_addr = inet_addr(targetIp);
+            // Logged from the parsed address, since targetIp needn't outlive the log record
+            uint32_t ip = ntohl(targetAddr.sin_addr.s_addr);
+            LOG_INFO("Opening a socket on %u.%u.%u.%u:%d\n",
+                (unsigned)(ip >> 24), (unsigned)(ip >> 16) & 0xFF, (unsigned)(ip >> 8) & 0xFF, (unsigned)ip & 0xFF, port);
 
-            memset(&bindAddr, 0, sizeof(bindAddr));
-            bindAddr.sin_family    = AF_INET; // IPv4 
-            bindAddr.sin_addr.s_addr = INADDR_ANY; 
-            bindAddr.sin_port = htons(port); 
+            // Match all IPs on the local port (0.0.0.0)
+            net::makeAddr(bindAddr, nullptr, localPort == SAME_PORT ? port : localPort);
 
             // Create UDP socket
-            native = net_socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+            native = net::openUdp();
             if (native == INVALID_SOCKET || native < 0)
             {
-                printf("Cannot create a socket!\n");
+                LOG_ERROR("Cannot create a socket!\n");
             }
 
-            
-            printf("Target:%s", inet_ntoa(*(in_addr*)&bindAddr.sin_addr));
-
             // Bind socket for packets to be sent back to it
-            ret = net_bind(native, (sockaddr *)&bindAddr, sizeof(bindAddr));
+            ret = net::bind(native, bindAddr);
             if (ret < 0)
             {
-                perror("Failed to bind");
+                LOG_ERROR("Failed to bind: %d\n", ret);
             }
 
             // Set nonblocking
-            // ret = net_fcntl(sock, F_SETFL, net_fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
-            // if (ret == -1) { printf("Cannot set nonblocking"); }
+            ret = net::setNonblocking(native);
+            if (ret < 0) { LOG_ERROR("Cannot set nonblocking\n"); }
         }
 
         void handlePollResult(int events)
         {
-            int ret = -999;
-
             if (events & (POLLERR | POLLHUP | POLLNVAL))
             {
-                printf("Bad socket\n");
+                LOG_WARN("Bad socket\n");
             }
 
             if (events & POLLIN)
             {
-                printf("Ready to read!\n");
+                readAll();
+            }
 
+            if (events & POLLOUT)
+            {
+                sendAll();
+            }
+        }
 
+        // Read datagrams until the socket would block or the budget runs out
+        void readAll()
+        {
+            char *datas[RECV_BATCH];
+            size_t lens[RECV_BATCH];
+            size_t received = 0;
 
-                u32 readBytes = getTargetAddrSize();
-                //ret = net_recvfrom(native, readBuf.get(), readBufSize, 0, getTargetAddr(), &readBytes);
-                //ret = net_recvfrom(native, readBuf.get(), readBufSize, 0, nullptr, nullptr);
-                ret = net_read(native, readBuf.get(), 50000);
-                if (ret < 0)
-                {
-                    //printf("recvfrom error %d\n", ret);
-                    perror("Recvfrom error"); 
-                }
-                else
+            for (size_t i = 0; i < RECV_BATCH; i++)
+            {
+                if (!readBufs[i].isValid())
                 {
-                    printf("Giving packet to processor of size %d ret %d\n", readBytes, ret);
-                    processor(readBuf.get(), readBuf.get() + ret);
+                    readBufs[i] = BufCache::getBuf(READ_BUF_SIZE);
                 }
+                datas[i] = readBufs[i].data();
             }
 
-            if (events & POLLOUT)
+            while (received < ioBudget)
             {
-                FixedBuf buf = pop();
+                int ret = net::recvBatch(native, datas, READ_BUF_SIZE, std::min(RECV_BATCH, ioBudget - received), lens);
+                if (net::wouldBlock(ret))
+                {
+                    break;
+                }
+                else if (ret < 0)
+                {
+                    LOG_WARN("Recvfrom error %d\n", ret);
+                    break;
+                }
 
-                if (buf.size() > 0)
+                for (int i = 0; i < ret; i++)
                 {
-                    printf("Sending with a size of %u\n", buf.size());
-                    ret = net_sendto(native, buf.data(), buf.size(), 0, getTargetAddr(), getTargetAddrSize());
-                    if (ret < 0)
+                    FixedBuf &datagram = readBufs[i];
+                    datagram.len = lens[i];
+
+                    if (capture != nullptr)
                     {
-                        printf("Got error with sendto %d", errno);
+                        capture->record(Capture::Direction::RECEIVED, datagram.data(), lens[i], currentTimeNs());
                     }
 
-                    BufCache::recycle(std::move(buf));
+                    LOG_TRACE("Giving packet to processor of size %u\n", (unsigned)lens[i]);
+                    processor(processorCtx, datagram);
+
+                    // A handler kept a share of it, so read the next datagram somewhere else
+                    if (!datagram.unique())
+                    {
+                        datagram = BufCache::getBuf(READ_BUF_SIZE);
+                        datas[i] = datagram.data();
+                    }
+                    datagram.len = READ_BUF_SIZE;
                 }
-            }
 
-            // if (events &)
+                received += ret;
+            }
         }
 
-        /*template <typename CallbackT>
-        void poll(CallbackT cbRead, CallbackT cbWrite, CallbackT cbError)
+        // Send queued packets until the socket would block, the queue is empty or the budget runs out
+        void sendAll()
         {
-            pollsd pollinfo = { .socket = sock, .events = POLLIN | POLLOUT, .revents = 0 };
-            net_poll(&pollinfo, 1, 0);
-        }*/
+            const net::Segment *segments[SEND_BATCH];
+            size_t segmentCounts[SEND_BATCH];
+            size_t sent = 0;
+
+            while (sent < ioBudget)
+            {
+                size_t count = 0;
+                size_t limit = std::min(SEND_BATCH, ioBudget - sent);
+                for (GatherBuf *buf = nullptr; count < limit && (buf = writeQueue.peek(count)) != nullptr; count++)
+                {
+                    segments[count] = buf->segments;
+                    segmentCounts[count] = buf->count;
+                }
+
+                if (count == 0)
+                {
+                    disarmWriteIfEmpty();
+                    return;
+                }
+
+                int ret = net::sendBatch(native, segments, segmentCounts, count, targetAddr);
+                if (net::wouldBlock(ret))
+                {
+                    // Stay armed, POLLOUT will fire again once the socket drains
+                    return;
+                }
+                else if (ret < 0)
+                {
+                    // Drop the packet at the front so one bad datagram can't wedge the queue
+                    LOG_WARN("Got error with sendto %d\n", ret);
+                    ret = 1;
+                }
+                else if (capture != nullptr)
+                {
+                    int64_t now = currentTimeNs();
+                    for (int i = 0; i < ret; i++)
+                    {
+                        capture->record(Capture::Direction::SENT, *writeQueue.peek(i), now);
+                    }
+                }
+
+                for (int i = 0; i < ret; i++)
+                {
+                    writeQueue.peek(i)->reset();
+                }
+                writeQueue.discard(ret);
+
+                sent += ret;
+            }
+        }
 
         // Push a packet to the queue to be sent and later freed
-        void write(FixedBuf &&buf)
+        // Returns false if the queue was full, in which case writePolicy decides what happened to buf
+        bool write(FixedBuf &&buf)
         {
-            LockGuardMutex lock(writeQueueMutex);
-            writeQueue.emplace_back(std::move(buf));
+            GatherBuf datagram(std::move(buf));
+            if (!write(std::move(datagram)))
+            {
+                if (writePolicy == WritePolicy::REJECT)
+                {
+                    buf = std::move(datagram.head);
+                }
+                return false;
+            }
+            return true;
         }
 
-        // Take a packet for sending
-        FixedBuf pop()
+        // Push a datagram made of pieces, which are let go of once it is sent
+        bool write(GatherBuf &&datagram)
         {
-            LockGuardMutex lock(writeQueueMutex);
+#ifdef GEKKO
+            // net_sendto copies into an IOS buffer anyway, so putting it together first costs nothing extra
+            if (!datagram.flatten())
+            {
+                droppedWrites.fetch_add(1, std::memory_order_relaxed);
+                datagram.reset();
+                return false;
+            }
+#endif
 
-            if (writeQueue.size() > 0)
+            if (!writeQueue.push(std::move(datagram)))
             {
-                FixedBuf ret = std::move(writeQueue.front());
-                writeQueue.pop_front();
-                return ret;
+                if (writePolicy == WritePolicy::DROP_NEWEST)
+                {
+                    droppedWrites.fetch_add(1, std::memory_order_relaxed);
+                    datagram.reset();
+                }
+
+                return false;
             }
-            else
+
+            if (!writeArmed.exchange(true, std::memory_order_acq_rel))
             {
-                return FixedBuf();
+                SocketPool::setWriteInterest(*this, true);
             }
+
+            return true;
+        }
+
+        // Stop waking on POLLOUT once there is nothing left to send
+        // The consumer disarms first and then looks again, so a write() racing with this re-arms
+        void disarmWriteIfEmpty()
+        {
+            if (!writeArmed.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            SocketPool::setWriteInterest(*this, false);
+            writeArmed.exchange(false, std::memory_order_acq_rel);
+
+            if (!writeQueue.empty() && !writeArmed.exchange(true, std::memory_order_acq_rel))
+            {
+                SocketPool::setWriteInterest(*this, true);
+            }
+        }
+
+        // Take a packet for sending
+        GatherBuf pop()
+        {
+            GatherBuf ret;
+            writeQueue.pop(ret);
+            return ret;
         }
 
         // Handled by SocketPool
@@ -196,7 +350,8 @@ namespace librobocol
         {
             if (native > 0)
             {
-                net_close(native);
+                SocketPool::remove(*this);
+                net::close(native);
             }
         }
 
@@ -0,0 +1,137 @@
+#if !defined(LIBROBOCOL_WAKER_H)
+#define LIBROBOCOL_WAKER_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "netcompat.h"
+#include "log.h"
+#include "Socket.h"
+#include "SocketPool.h"
+
+namespace librobocol
+{
+    // Interrupts a thread blocked in SocketPool::tick() from another thread
+    // A loopback UDP socket sends a byte to itself, which makes the poll return. libogc has no pipes
+    // or eventfd, but both platforms can poll a socket. Wakes are coalesced, so a burst of wake()
+    // calls before the poller gets round to them costs one datagram.
+    // Each Waker binds a port of its own, so any number of them (in one process or several) can
+    // share a host without one's wakes reaching another.
+    class Waker : public NativeSocket
+    {
+    public:
+#ifdef GEKKO
+        // libogc can't report the port picked for port 0, so the first free one from here up is used
+        static constexpr uint16_t PORT_BASE = 20885;
+        static constexpr uint16_t PORT_TRIES = 16;
+#endif
+
+        // Called on the polling thread after a wake
+        using WakeFn = void (*)(void *ctx);
+
+    private:
+        int native = INVALID_SOCKET;
+        sockaddr_in addr = {};
+        std::atomic_bool pending = false;
+
+        WakeFn onWake = nullptr;
+        void *onWakeCtx = nullptr;
+
+    public:
+        Waker(WakeFn onWake, void *onWakeCtx) :
+            onWake(onWake), onWakeCtx(onWakeCtx)
+        {
+            native = net::openUdp();
+            if (native < 0)
+            {
+                LOG_ERROR("Cannot create a wake socket\n");
+                return;
+            }
+
+#ifdef GEKKO
+            int ret = -1;
+            for (uint16_t port = PORT_BASE; ret < 0 && port < PORT_BASE + PORT_TRIES; port++)
+            {
+                net::makeAddr(addr, "127.0.0.1", port);
+                ret = net::bind(native, addr);
+            }
+#else
+            // The kernel picks a free port, and wakes are sent to whichever one it was
+            net::makeAddr(addr, "127.0.0.1", 0);
+            int ret = net::bind(native, addr);
+            if (ret >= 0)
+            {
+                ret = net::localAddr(native, addr);
+            }
+#endif
+            if (ret < 0)
+            {
+                LOG_ERROR("Cannot bind a wake socket\n");
+            }
+
+            net::setNonblocking(native);
+        }
+
+        Waker(const Waker&) = delete;
+        Waker& operator=(const Waker&) = delete;
+
+        // Safe from any thread
+        void wake()
+        {
+            if (pending.exchange(true, std::memory_order_acq_rel))
+            {
+                return;
+            }
+
+            char byte = 0;
+            net::sendTo(native, &byte, 1, addr);
+        }
+
+        int getSocketHandle() const noexcept
+        {
+            return native;
+        }
+
+        void handlePollResult(int events)
+        {
+            // SocketPool::add() asks for POLLOUT, which a UDP socket nearly always has
+            if (events & POLLOUT)
+            {
+                SocketPool::setWriteInterest(*this, false);
+            }
+
+            if (!(events & POLLIN))
+            {
+                return;
+            }
+
+            // Clear before draining, so a wake() that races with this sends a fresh byte
+            pending.store(false, std::memory_order_release);
+
+            char bytes[16];
+            while (net::recv(native, bytes, sizeof(bytes)) > 0) {}
+
+            if (onWake != nullptr)
+            {
+                onWake(onWakeCtx);
+            }
+        }
+
+        // Nothing to send, wakes go out directly from wake()
+        bool write(FixedBuf &&buf)
+        {
+            return false;
+        }
+
+        ~Waker()
+        {
+            SocketPool::remove(*this);
+            if (native >= 0)
+            {
+                net::close(native);
+            }
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_WAKER_H)
@@ -0,0 +1,27 @@
+#if !defined(LIBROBOCOL_CLOCK_H)
+#define LIBROBOCOL_CLOCK_H
+
+#include <cstdint>
+
+#ifdef GEKKO
+#include <ogc/lwp_watchdog.h>
+#else
+#include <chrono>
+#endif
+
+namespace librobocol
+{
+    // Monotonic time in nanoseconds. Every deadline and timestamp in the library uses this clock.
+    inline int64_t currentTimeNs()
+    {
+#ifdef GEKKO
+        return ticks_to_nanosecs(gettime());
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+}
+
+#endif // if !defined(LIBROBOCOL_CLOCK_H)
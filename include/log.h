@@ -0,0 +1,252 @@
+#if !defined(LIBROBOCOL_LOG_H)
+#define LIBROBOCOL_LOG_H
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "clock.h"
+
+// Usage:
+// LOG_DEBUG("Sending %u bytes\n", (unsigned)size);
+//
+// A call below LIBROBOCOL_LOG_LEVEL compiles to nothing. A call at or above it copies the format
+// pointer and the raw arguments into a lock-free ring, and formatting happens later when the main
+// loop (or a low-priority thread) calls librobocol::Log::flush(). That keeps printf, and on the Wii the
+// framebuffer console it draws to, off the packet path.
+// Since a message can be printed well after it was logged, each line starts with the time it was
+// logged, in seconds since startup, and its level: "[   1.234 W] Bad socket".
+//
+// Arguments are copied bit for bit, so they must be trivially copyable, and any const char* must
+// point at storage that outlives the flush (string literals, typeid names, parseErrorName()).
+
+#define LIBROBOCOL_LOG_TRACE 0
+#define LIBROBOCOL_LOG_DEBUG 1
+#define LIBROBOCOL_LOG_INFO 2
+#define LIBROBOCOL_LOG_WARN 3
+#define LIBROBOCOL_LOG_ERROR 4
+#define LIBROBOCOL_LOG_OFF 5
+
+#ifndef LIBROBOCOL_LOG_LEVEL
+#ifdef NDEBUG
+#define LIBROBOCOL_LOG_LEVEL LIBROBOCOL_LOG_WARN
+#else
+#define LIBROBOCOL_LOG_LEVEL LIBROBOCOL_LOG_DEBUG
+#endif
+#endif
+
+// The printf that is never run is there for -Wformat, which can't see through the deferred one
+#define LIBROBOCOL_LOG_AT(level, ...) \
+    do { \
+        if (false) { printf(__VA_ARGS__); } \
+        if constexpr (LIBROBOCOL_LOG_##level >= LIBROBOCOL_LOG_LEVEL) { librobocol::Log::write(librobocol::Log::Level::level, __VA_ARGS__); } \
+    } while (0)
+
+#define LOG_TRACE(...) LIBROBOCOL_LOG_AT(TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LIBROBOCOL_LOG_AT(DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LIBROBOCOL_LOG_AT(INFO, __VA_ARGS__)
+#define LOG_WARN(...) LIBROBOCOL_LOG_AT(WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LIBROBOCOL_LOG_AT(ERROR, __VA_ARGS__)
+
+namespace librobocol
+{
+    class Log
+    {
+    public:
+        enum class Level : uint8_t
+        {
+            TRACE = LIBROBOCOL_LOG_TRACE,
+            DEBUG = LIBROBOCOL_LOG_DEBUG,
+            INFO = LIBROBOCOL_LOG_INFO,
+            WARN = LIBROBOCOL_LOG_WARN,
+            ERROR = LIBROBOCOL_LOG_ERROR
+        };
+
+        static constexpr size_t ARG_BYTES = 48;
+#ifdef GEKKO
+        static constexpr size_t CAPACITY = 256;
+#else
+        static constexpr size_t CAPACITY = 1024;
+#endif
+
+        struct Record
+        {
+            const char *fmt;
+            void (*print)(const Record &);
+            int64_t timeNs;
+            Level level;
+            char args[ARG_BYTES];
+        };
+
+    private:
+        // Bounded multi-producer queue with a sequence number per cell, so producers claim a cell with
+        // one compare-and-swap and the single flushing consumer never needs a lock
+        struct Cell
+        {
+            std::atomic<size_t> seq;
+            Record rec;
+        };
+
+        struct Ring
+        {
+            std::array<Cell, CAPACITY> cells;
+            std::atomic<size_t> enqueuePos = 0;
+            size_t dequeuePos = 0;
+
+            Ring()
+            {
+                for (size_t i = 0; i < CAPACITY; i++)
+                {
+                    cells[i].seq.store(i, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        static Ring ring;
+        static std::atomic<size_t> droppedCount;
+        static const int64_t startNs;
+
+        static constexpr char levelLetter(Level level)
+        {
+            switch (level)
+            {
+            case Level::TRACE: return 'T';
+            case Level::DEBUG: return 'D';
+            case Level::INFO: return 'I';
+            case Level::WARN: return 'W';
+            case Level::ERROR: return 'E';
+            }
+            return '?';
+        }
+
+        template <typename... Args>
+        static constexpr std::array<size_t, sizeof...(Args) + 1> argOffsets()
+        {
+            std::array<size_t, sizeof...(Args) + 1> offsets{};
+            size_t sizes[] = {sizeof(Args)..., 0};
+            for (size_t i = 0; i < sizeof...(Args); i++)
+            {
+                offsets[i + 1] = offsets[i] + sizes[i];
+            }
+            return offsets;
+        }
+
+        template <typename T>
+        static T unpack(const char *bytes)
+        {
+            T val;
+            memcpy(&val, bytes, sizeof(T));
+            return val;
+        }
+
+        template <typename... Args, size_t... I>
+        static void printArgs(const Record &rec, std::index_sequence<I...>)
+        {
+            constexpr auto offsets = argOffsets<Args...>();
+            (void)offsets;
+
+            #pragma GCC diagnostic push
+            #pragma GCC diagnostic ignored "-Wformat-security"
+            #pragma GCC diagnostic ignored "-Wformat-nonliteral"
+            printf(rec.fmt, unpack<Args>(rec.args + offsets[I])...);
+            #pragma GCC diagnostic pop
+        }
+
+        template <typename... Args>
+        static void printRecord(const Record &rec)
+        {
+            printArgs<Args...>(rec, std::index_sequence_for<Args...>{});
+        }
+
+    public:
+        // Queue a message. Drops it (and counts the drop) if the ring is full rather than waiting.
+        template <typename... Args>
+        static void write(Level level, const char *fmt, Args... args)
+        {
+            static_assert((std::is_trivially_copyable_v<Args> && ...), "Log arguments are copied bytewise");
+            static_assert(argOffsets<Args...>()[sizeof...(Args)] <= ARG_BYTES, "Too many log arguments");
+
+            size_t pos = ring.enqueuePos.load(std::memory_order_relaxed);
+            Cell *cell = nullptr;
+
+            while (true)
+            {
+                cell = &ring.cells[pos % CAPACITY];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+                if (diff == 0)
+                {
+                    if (ring.enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    droppedCount.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                else
+                {
+                    pos = ring.enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+
+            Record &rec = cell->rec;
+            rec.fmt = fmt;
+            rec.print = &printRecord<Args...>;
+            rec.timeNs = currentTimeNs();
+            rec.level = level;
+
+            constexpr auto offsets = argOffsets<Args...>();
+            size_t i = 0;
+            ((memcpy(rec.args + offsets[i++], &args, sizeof(Args))), ...);
+            (void)offsets;
+            (void)i;
+
+            cell->seq.store(pos + 1, std::memory_order_release);
+        }
+
+        // Print up to maxRecords queued messages. Only one thread may flush at a time.
+        static size_t flush(size_t maxRecords = SIZE_MAX)
+        {
+            size_t printed = 0;
+
+            while (printed < maxRecords)
+            {
+                size_t pos = ring.dequeuePos;
+                Cell &cell = ring.cells[pos % CAPACITY];
+
+                if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+                {
+                    break;
+                }
+
+                printf("[%8.3f %c] ", (cell.rec.timeNs - startNs) / 1e9, levelLetter(cell.rec.level));
+                cell.rec.print(cell.rec);
+
+                cell.seq.store(pos + CAPACITY, std::memory_order_release);
+                ring.dequeuePos = pos + 1;
+                printed++;
+            }
+
+            size_t dropped = droppedCount.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                printf("[log] dropped %u messages\n", (unsigned)dropped);
+            }
+
+            return printed;
+        }
+    };
+    Log::Ring Log::ring;
+    std::atomic<size_t> Log::droppedCount = 0;
+    const int64_t Log::startNs = currentTimeNs();
+}
+
+#endif // if !defined(LIBROBOCOL_LOG_H)
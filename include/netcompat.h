@@ -0,0 +1,243 @@
+#if !defined(LIBROBOCOL_NETCOMPAT_H)
+#define LIBROBOCOL_NETCOMPAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+// Thin shim over the two socket APIs we run on: libogc's net_ functions on the Wii/GameCube and
+// plain POSIX sockets on a host. Every function returns a negative errno value on failure, which is
+// what the libogc calls already do, so callers can check for -EAGAIN the same way on both.
+
+#ifdef GEKKO
+
+#include <network.h>
+#include <errno.h>
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET (~0)
+#endif
+
+#endif
+
+namespace librobocol
+{
+    namespace net
+    {
+#ifdef GEKKO
+        using socklen = u32;
+#else
+        using socklen = socklen_t;
+#endif
+
+        // Fill an IPv4 address. A null ip means INADDR_ANY.
+        inline bool makeAddr(sockaddr_in &addr, const char *ip, uint16_t port)
+        {
+            memset(&addr, 0, sizeof(addr));
+#ifdef GEKKO
+            addr.sin_len = sizeof(addr);
+#endif
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+
+            if (ip == nullptr)
+            {
+                addr.sin_addr.s_addr = INADDR_ANY;
+                return true;
+            }
+
+            addr.sin_addr.s_addr = inet_addr(ip);
+            return addr.sin_addr.s_addr != 0 && addr.sin_addr.s_addr != INADDR_NONE;
+        }
+
+        inline int openUdp()
+        {
+#ifdef GEKKO
+            return net_socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+#else
+            int ret = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            return ret < 0 ? -errno : ret;
+#endif
+        }
+
+        inline int bind(int sock, const sockaddr_in &addr)
+        {
+#ifdef GEKKO
+            return net_bind(sock, (sockaddr *)&addr, sizeof(addr));
+#else
+            int ret = ::bind(sock, (const sockaddr *)&addr, sizeof(addr));
+            return ret < 0 ? -errno : ret;
+#endif
+        }
+
+#ifndef GEKKO
+        // The address a socket is bound to, which is how to find the port the kernel picked for port 0
+        inline int localAddr(int sock, sockaddr_in &addr)
+        {
+            socklen len = sizeof(addr);
+            int ret = ::getsockname(sock, (sockaddr *)&addr, &len);
+            return ret < 0 ? -errno : ret;
+        }
+#endif
+
+        inline int setNonblocking(int sock)
+        {
+#ifdef GEKKO
+            return net_fcntl(sock, F_SETFL, net_fcntl(sock, F_GETFL, 0) | IOS_O_NONBLOCK);
+#else
+            int ret = ::fcntl(sock, F_SETFL, ::fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+            return ret < 0 ? -errno : ret;
+#endif
+        }
+
+        inline int recv(int sock, char *buf, size_t len)
+        {
+#ifdef GEKKO
+            return net_read(sock, buf, len);
+#else
+            ssize_t ret = ::recv(sock, buf, len, 0);
+            return ret < 0 ? -errno : (int)ret;
+#endif
+        }
+
+        inline int sendTo(int sock, const char *buf, size_t len, const sockaddr_in &addr)
+        {
+#ifdef GEKKO
+            return net_sendto(sock, buf, len, 0, (sockaddr *)&addr, sizeof(addr));
+#else
+            ssize_t ret = ::sendto(sock, buf, len, 0, (const sockaddr *)&addr, sizeof(addr));
+            return ret < 0 ? -errno : (int)ret;
+#endif
+        }
+
+        // Receive up to count datagrams, each into its own bufSize byte buffer, storing each length.
+        // Uses recvmmsg on POSIX, so a burst costs one syscall. Returns how many were received.
+        inline int recvBatch(int sock, char *const *bufs, size_t bufSize, size_t count, size_t *lens)
+        {
+#ifdef GEKKO
+            (void)count;
+            int ret = net_read(sock, bufs[0], bufSize);
+            if (ret >= 0)
+            {
+                lens[0] = ret;
+                return 1;
+            }
+            return ret;
+#else
+            constexpr size_t MAX_BATCH = 64;
+            count = std::min(count, MAX_BATCH);
+
+            mmsghdr msgs[MAX_BATCH];
+            iovec iovs[MAX_BATCH];
+            for (size_t i = 0; i < count; i++)
+            {
+                iovs[i] = {bufs[i], bufSize};
+                msgs[i] = {};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int ret = ::recvmmsg(sock, msgs, count, MSG_DONTWAIT, nullptr);
+            if (ret < 0)
+            {
+                return -errno;
+            }
+
+            for (int i = 0; i < ret; i++)
+            {
+                lens[i] = msgs[i].msg_len;
+            }
+            return ret;
+#endif
+        }
+
+        // A piece of a datagram, for sends gathered from several buffers
+        struct Segment
+        {
+            const char *data;
+            size_t len;
+        };
+
+        // Send count datagrams to addr, datagram i being the segmentCounts[i] segments at segments[i].
+        // Uses sendmmsg on POSIX, so a burst costs one syscall and the kernel gathers each datagram's
+        // segments itself. libogc has no sendmsg, so there every datagram must be one segment.
+        // Returns how many were sent, which can be short, or a negative error if none were.
+        inline int sendBatch(int sock, const Segment *const *segments, const size_t *segmentCounts, size_t count, const sockaddr_in &addr)
+        {
+#ifdef GEKKO
+            int sent = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                assert(segmentCounts[i] <= 1);
+                const Segment &segment = segmentCounts[i] > 0 ? segments[i][0] : Segment{"", 0};
+                int ret = net_sendto(sock, segment.data, segment.len, 0, (sockaddr *)&addr, sizeof(addr));
+                if (ret < 0)
+                {
+                    return sent > 0 ? sent : ret;
+                }
+                sent++;
+            }
+            return sent;
+#else
+            constexpr size_t MAX_BATCH = 64;
+            constexpr size_t MAX_IOVECS = 256;
+            count = std::min(count, MAX_BATCH);
+
+            mmsghdr msgs[MAX_BATCH];
+            iovec iovs[MAX_IOVECS];
+            size_t iovCount = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                // Whatever doesn't fit goes in the next call
+                if (iovCount + segmentCounts[i] > MAX_IOVECS && i > 0)
+                {
+                    count = i;
+                    break;
+                }
+
+                msgs[i] = {};
+                msgs[i].msg_hdr.msg_name = (void *)&addr;
+                msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+                msgs[i].msg_hdr.msg_iov = &iovs[iovCount];
+                msgs[i].msg_hdr.msg_iovlen = segmentCounts[i];
+
+                for (size_t j = 0; j < segmentCounts[i]; j++)
+                {
+                    iovs[iovCount++] = {(void *)segments[i][j].data, segments[i][j].len};
+                }
+            }
+
+            int ret = ::sendmmsg(sock, msgs, count, MSG_DONTWAIT);
+            return ret < 0 ? -errno : ret;
+#endif
+        }
+
+        inline void close(int sock)
+        {
+#ifdef GEKKO
+            net_close(sock);
+#else
+            ::close(sock);
+#endif
+        }
+
+        inline bool wouldBlock(int err)
+        {
+            return err == -EAGAIN || err == -EWOULDBLOCK;
+        }
+    }
+}
+
+#endif // if !defined(LIBROBOCOL_NETCOMPAT_H)
@@ -0,0 +1,220 @@
+#if !defined(LIBROBOCOL_ROBOCOL_COMMANDCHANNEL_H)
+#define LIBROBOCOL_ROBOCOL_COMMANDCHANNEL_H
+
+#include <array>
+#include <cstdint>
+#include <cassert>
+
+#include "log.h"
+#include "TimerWheel.h"
+#include "packet.h"
+
+namespace librobocol
+{
+    // Delivers commands reliably over UDP
+    // Each command we send sits in a fixed table until the robot acks it, and is resent on a timer
+    // until then or until it runs out of attempts. Acks find their entry through a hash of the
+    // sequence number, so retiring one is a bucket lookup and a timer cancel, not a scan.
+    // Commands the robot sends us are acked every time they arrive, since our ack may be what got
+    // lost, but only reported once.
+    class CommandChannel
+    {
+    public:
+        static constexpr size_t MAX_OUTSTANDING = 32;
+        static constexpr size_t BUCKETS = 64;
+        static constexpr size_t RECENT_RECEIVED = 64; // Received commands remembered for duplicates
+
+        static constexpr int64_t RETRANSMIT_NS = 100'000'000;
+        static constexpr int MAX_ATTEMPTS = 10;
+        static constexpr int64_t LIFETIME_NS = RETRANSMIT_NS * MAX_ATTEMPTS;
+
+        // Puts a command on the wire
+        using SendFn = void (*)(void *ctx, Command &command);
+
+        struct Stats
+        {
+            size_t sent = 0; // First transmissions
+            size_t retransmits = 0;
+            size_t acked = 0;
+            size_t timeouts = 0; // Gave up without an ack
+            size_t rejected = 0; // Not sent because the table was full or the command was too large
+            size_t strayAcks = 0; // Acks for nothing we're waiting on
+            size_t received = 0; // New commands from the robot
+            size_t duplicates = 0; // Repeats of commands already received
+        };
+
+    private:
+        static constexpr uint8_t NONE = 0xFF;
+
+        struct Outstanding
+        {
+            Command command;
+            Timer timer;
+            CommandChannel *channel = nullptr;
+            uint8_t nextInBucket = NONE;
+            uint8_t nextFree = NONE;
+        };
+
+        struct Seen
+        {
+            bool valid = false;
+            uint16_t sequenceNum = 0;
+            int64_t timestamp = 0;
+        };
+
+        std::array<Outstanding, MAX_OUTSTANDING> outstanding;
+        std::array<uint8_t, BUCKETS> buckets;
+        uint8_t freeHead = 0;
+        size_t active = 0;
+
+        std::array<Seen, RECENT_RECEIVED> seen;
+
+        TimerWheel &timers;
+        SendFn sendFn;
+        void *sendCtx;
+
+        Stats stats;
+
+        uint8_t &bucketFor(uint16_t sequenceNum)
+        {
+            return buckets[sequenceNum & (BUCKETS - 1)];
+        }
+
+        void release(uint8_t index)
+        {
+            Outstanding &entry = outstanding[index];
+            timers.cancel(entry.timer);
+
+            // Unlink from its bucket, which almost always holds just this entry
+            uint8_t *link = &bucketFor(entry.command.getSequenceNum());
+            while (*link != index)
+            {
+                assert(*link != NONE);
+                link = &outstanding[*link].nextInBucket;
+            }
+            *link = entry.nextInBucket;
+
+            entry.command = Command();
+            entry.nextInBucket = NONE;
+            entry.nextFree = freeHead;
+            freeHead = index;
+            active--;
+        }
+
+        static void onRetransmit(void *ctx, int64_t nowNs)
+        {
+            Outstanding &entry = *(Outstanding *)ctx;
+            CommandChannel &self = *entry.channel;
+            Command &command = entry.command;
+
+            if (command.attempts >= MAX_ATTEMPTS || nowNs >= command.transmissionDeadlineNs)
+            {
+                LOG_WARN("Command %u timed out after %d attempts\n", (unsigned)command.getSequenceNum(), (int)command.attempts);
+                self.stats.timeouts++;
+                self.release(&entry - self.outstanding.data());
+                return;
+            }
+
+            command.attempts++;
+            self.stats.retransmits++;
+            self.sendFn(self.sendCtx, command);
+            self.timers.schedule(entry.timer, nowNs + RETRANSMIT_NS);
+        }
+
+    public:
+        CommandChannel(TimerWheel &timers, SendFn sendFn, void *sendCtx) :
+            timers(timers), sendFn(sendFn), sendCtx(sendCtx)
+        {
+            buckets.fill(NONE);
+
+            for (size_t i = 0; i < MAX_OUTSTANDING; i++)
+            {
+                outstanding[i].channel = this;
+                outstanding[i].timer = Timer(&CommandChannel::onRetransmit, &outstanding[i]);
+                outstanding[i].nextFree = i + 1 < MAX_OUTSTANDING ? i + 1 : NONE;
+            }
+        }
+
+        CommandChannel(const CommandChannel&) = delete;
+        CommandChannel& operator=(const CommandChannel&) = delete;
+
+        // Send a command and keep resending it until it is acked. Returns false if too many are
+        // already waiting, or if it is too large to encode.
+        bool send(Command &&command, int64_t nowNs)
+        {
+            if (freeHead == NONE || !command.isValid())
+            {
+                stats.rejected++;
+                return false;
+            }
+
+            uint8_t index = freeHead;
+            Outstanding &entry = outstanding[index];
+            freeHead = entry.nextFree;
+            active++;
+
+            entry.command = std::move(command);
+            entry.command.acknowledged = false;
+            entry.command.attempts = 1;
+            entry.command.transmissionDeadlineNs = nowNs + LIFETIME_NS;
+
+            uint8_t &bucket = bucketFor(entry.command.getSequenceNum());
+            entry.nextInBucket = bucket;
+            bucket = index;
+
+            stats.sent++;
+            sendFn(sendCtx, entry.command);
+            timers.schedule(entry.timer, nowNs + RETRANSMIT_NS);
+
+            return true;
+        }
+
+        // The robot acked one of our commands. Returns false if we weren't waiting on it.
+        bool onAck(const Command &ack)
+        {
+            for (uint8_t index = bucketFor(ack.getSequenceNum()); index != NONE; index = outstanding[index].nextInBucket)
+            {
+                const Command &command = outstanding[index].command;
+                if (command.getSequenceNum() == ack.getSequenceNum() && command.timestamp == ack.timestamp)
+                {
+                    stats.acked++;
+                    release(index);
+                    return true;
+                }
+            }
+
+            stats.strayAcks++;
+            return false;
+        }
+
+        // The robot sent us a command, which has been acked. Returns false if it is a repeat.
+        bool onReceive(const Command &command)
+        {
+            Seen &slot = seen[command.getSequenceNum() & (RECENT_RECEIVED - 1)];
+            if (slot.valid && slot.sequenceNum == command.getSequenceNum() && slot.timestamp == command.timestamp)
+            {
+                stats.duplicates++;
+                return false;
+            }
+
+            slot.valid = true;
+            slot.sequenceNum = command.getSequenceNum();
+            slot.timestamp = command.timestamp;
+
+            stats.received++;
+            return true;
+        }
+
+        size_t outstandingCount() const
+        {
+            return active;
+        }
+
+        const Stats &getStats() const
+        {
+            return stats;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_COMMANDCHANNEL_H)
@@ -0,0 +1,113 @@
+#if !defined(LIBROBOCOL_ROBOCOL_CONTROLLERTABLE_H)
+#define LIBROBOCOL_ROBOCOL_CONTROLLERTABLE_H
+
+#include <array>
+#include <cstdint>
+
+#include "packet.h"
+
+namespace librobocol
+{
+    // State for every controller channel, and which robocol user each one drives
+    // Robocol only has users 1 and 2. They go to the first two controllers to connect and stay with
+    // them until they disconnect, when the user is handed to the next controller that connects.
+    // A controller's id on the wire is its channel.
+    class ControllerTable
+    {
+    public:
+        static constexpr size_t MAX_CONTROLLERS = 4; // WPAD_MAX_WIIMOTES
+        static constexpr uint8_t MAX_USERS = 2;
+        static constexpr uint8_t NO_USER = 0; // On a packet, means the controller left
+
+        struct Slot
+        {
+            GamepadPacket last;
+            bool connected = false;
+            uint8_t user = NO_USER;
+        };
+
+    private:
+        std::array<Slot, MAX_CONTROLLERS> slots;
+
+        uint8_t freeUser() const
+        {
+            for (uint8_t user = 1; user <= MAX_USERS; user++)
+            {
+                bool taken = false;
+                for (const Slot &slot : slots)
+                {
+                    taken = taken || slot.user == user;
+                }
+
+                if (!taken)
+                {
+                    return user;
+                }
+            }
+            return NO_USER;
+        }
+
+    public:
+        // Record a channel's latest scan and call emit(GamepadPacket&&) if the robot needs to hear
+        // about it. A controller that disconnects emits one packet with user NO_USER.
+        // emit returns false if the packet couldn't be queued, and it is tried again on the next
+        // scan. A disconnect must get through, or the robot keeps driving on the controller's last
+        // input, so the slot keeps its user until it has.
+        template <typename EmitT>
+        void update(size_t channel, bool connected, GamepadPacket &&state, EmitT &&emit)
+        {
+            Slot &slot = slots[channel];
+
+            if (!connected)
+            {
+                if (slot.connected && slot.user != NO_USER)
+                {
+                    GamepadPacket gone;
+                    gone.id = (int32_t)channel;
+                    gone.user = NO_USER;
+                    if (!emit(std::move(gone)))
+                    {
+                        return;
+                    }
+                }
+
+                slot = Slot();
+                return;
+            }
+
+            slot.connected = true;
+
+            // Newly connected, or waiting for someone else to free a user
+            if (slot.user == NO_USER)
+            {
+                slot.user = freeUser();
+                if (slot.user == NO_USER)
+                {
+                    return;
+                }
+
+                slot.last = GamepadPacket();
+                slot.last.buttons = -1; // Make the first scan count as a change
+            }
+
+            state.id = (int32_t)channel;
+            state.user = slot.user;
+
+            if (!(state == slot.last))
+            {
+                slot.last = state;
+                if (!emit(std::move(state)))
+                {
+                    slot.last.buttons = -1; // Still a change on the next scan
+                }
+            }
+        }
+
+        const Slot &get(size_t channel) const
+        {
+            return slots[channel];
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_CONTROLLERTABLE_H)
@@ -0,0 +1,142 @@
+#if !defined(LIBROBOCOL_ROBOCOL_GAMEPADSTREAMER_H)
+#define LIBROBOCOL_ROBOCOL_GAMEPADSTREAMER_H
+
+#include <cstdint>
+#include <algorithm>
+
+#include "packet.h"
+
+namespace librobocol
+{
+    struct GamepadStreamConfig
+    {
+        int rateHz = 100; // Most sends per second, clamped to 50..200
+        int64_t keepaliveNs = 100'000'000; // Longest gap between sends
+    };
+
+    // Decides when a controller's state goes out
+    // A new state is sent as soon as it differs from the last one sent, but no more often than
+    // rateHz. States that arrive faster than that replace each other, so only the newest waiting one
+    // is ever sent. When nothing changes, the last state is sent again every keepaliveNs so a lost
+    // datagram can only leave the robot with stale input until the next keepalive.
+    class GamepadStreamer
+    {
+    public:
+        static constexpr int MIN_RATE_HZ = 50;
+        static constexpr int MAX_RATE_HZ = 200;
+        static constexpr int DEFAULT_RATE_HZ = GamepadStreamConfig().rateHz;
+        static constexpr int64_t DEFAULT_KEEPALIVE_NS = GamepadStreamConfig().keepaliveNs;
+
+        using Config = GamepadStreamConfig;
+
+        struct Stats
+        {
+            size_t changes = 0; // Sent because the state changed
+            size_t keepalives = 0; // Sent again unchanged
+            size_t coalesced = 0; // Replaced before they were sent
+        };
+
+    private:
+        GamepadPacket latest;
+        GamepadPacket lastSent;
+        bool hasLatest = false;
+        bool dirty = false; // latest differs from lastSent
+
+        int64_t minIntervalNs = 1'000'000'000 / DEFAULT_RATE_HZ;
+        int64_t keepaliveNs = DEFAULT_KEEPALIVE_NS;
+        int64_t lastSendNs = INT64_MIN / 2;
+
+        Stats stats;
+
+    public:
+        GamepadStreamer(const Config &config = Config())
+        {
+            configure(config);
+        }
+
+        void configure(const Config &config)
+        {
+            int rateHz = std::clamp(config.rateHz, MIN_RATE_HZ, MAX_RATE_HZ);
+            minIntervalNs = 1'000'000'000 / rateHz;
+            keepaliveNs = std::max(config.keepaliveNs, minIntervalNs);
+        }
+
+        // How often a producer should sample the controller to keep up with the send rate
+        int64_t sampleIntervalNs() const
+        {
+            return minIntervalNs;
+        }
+
+        // Take a newly sampled state
+        void offer(const GamepadPacket &state)
+        {
+            if (dirty)
+            {
+                stats.coalesced++;
+            }
+
+            latest = state;
+            hasLatest = true;
+            dirty = !(latest == lastSent);
+        }
+
+        // Send through sender(GamepadPacket&) if a send is due. Returns when to call this again.
+        template <typename SenderT>
+        int64_t poll(int64_t now, SenderT &&sender)
+        {
+            if (!hasLatest)
+            {
+                return INT64_MAX;
+            }
+
+            int64_t earliest = lastSendNs + minIntervalNs;
+            int64_t keepaliveAt = lastSendNs + keepaliveNs;
+
+            if (dirty && now >= earliest)
+            {
+                stats.changes++;
+                send(now, sender);
+            }
+            else if (!dirty && now >= keepaliveAt)
+            {
+                stats.keepalives++;
+                send(now, sender);
+            }
+
+            return dirty ? lastSendNs + minIntervalNs : lastSendNs + keepaliveNs;
+        }
+
+        // Stop sending, for a controller that has gone away
+        void clear()
+        {
+            hasLatest = false;
+            dirty = false;
+            lastSent = GamepadPacket();
+        }
+
+        // The state being streamed, if there is one
+        const GamepadPacket *current() const
+        {
+            return hasLatest ? &latest : nullptr;
+        }
+
+        const Stats &getStats() const
+        {
+            return stats;
+        }
+
+    private:
+        template <typename SenderT>
+        void send(int64_t now, SenderT &sender)
+        {
+            // Numbered as it goes out, so sampled states that are coalesced away don't use up numbers
+            latest.takeSequenceNum();
+            sender(latest);
+            lastSent = latest;
+            lastSendNs = now;
+            dirty = false;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_GAMEPADSTREAMER_H)
@@ -0,0 +1,287 @@
+#if !defined(LIBROBOCOL_ROBOCOL_NETWORKTHREAD_H)
+#define LIBROBOCOL_ROBOCOL_NETWORKTHREAD_H
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+#include "clock.h"
+#include "SpscRing.h"
+#include "SocketPool.h"
+#include "EventLoop.h"
+#include "Thread.h"
+#include "Waker.h"
+#include "packet.h"
+#include "RobocolConnection.h"
+#include "GamepadStreamer.h"
+#include "ControllerTable.h"
+
+namespace librobocol
+{
+    // Runs the robot connection on its own thread
+    // Once start() is called, the network thread is the only one that touches the connection or
+    // calls SocketPool::tick(). Everything else talks to it through single-producer queues: gamepad
+    // states go in, received packets and link status come out. A producer pushing a gamepad wakes the
+    // thread out of its poll, so a slow frame on the main thread can't hold up a send.
+    class NetworkThread
+    {
+    public:
+        static constexpr size_t GAMEPAD_QUEUE_DEPTH = 16;
+        static constexpr size_t COMMAND_QUEUE_DEPTH = 16;
+        static constexpr size_t INBOX_DEPTH = 64;
+        static constexpr size_t STATUS_DEPTH = 4;
+        static constexpr int PRIORITY = 80; // Above the main thread, which draws the screen
+
+        // Connection health, published once per connection tick
+        struct LinkStatus
+        {
+            int64_t atNs = 0;
+            PeerLink::State state = PeerLink::State::DISCOVERING;
+            int64_t rttNs = 0;
+            int64_t minRttNs = 0;
+            int64_t jitterNs = 0;
+            int64_t clockOffsetNs = 0;
+            size_t lostHeartbeats = 0;
+            size_t droppedWrites = 0;
+        };
+
+    private:
+        SpscRing<GamepadPacket> gamepads; // Main thread to network thread
+        SpscRing<Command> commandQueue; // Main thread to network thread
+        SpscRing<FixedBuf> inbox; // Network thread to main thread
+        SpscRing<LinkStatus> status; // Network thread to main thread
+
+        EventLoop loop;
+        size_t connectionTask = 0;
+        size_t inputTask = 0;
+
+        // A controller's streamer and the timer for its next send on the connection's wheel
+        struct GamepadStream
+        {
+            GamepadStreamer streamer;
+            Timer timer;
+            NetworkThread *owner = nullptr;
+        };
+
+        // One per controller channel, indexed by GamepadPacket::id
+        std::array<GamepadStream, ControllerTable::MAX_CONTROLLERS> gamepadStreams;
+
+        Thread thread;
+        std::atomic_bool stopRequested = false;
+
+    public:
+        RobocolConnection connection;
+        Waker waker;
+
+        NetworkThread(const char *robotIpStr, uint16_t port = RobocolConnection::ROBOCOL_PORT_DEFAULT,
+            const GamepadStreamer::Config &streamConfig = {},
+            int localPort = UdpSocket::SAME_PORT) :
+            gamepads(GAMEPAD_QUEUE_DEPTH), commandQueue(COMMAND_QUEUE_DEPTH), inbox(INBOX_DEPTH), status(STATUS_DEPTH),
+            connection(robotIpStr, port, localPort),
+            waker(&NetworkThread::onWake, this)
+        {
+            connection.inbox = &inbox;
+
+            for (GamepadStream &stream : gamepadStreams)
+            {
+                stream.streamer.configure(streamConfig);
+                stream.timer = Timer(&NetworkThread::onStreamDue, &stream);
+                stream.owner = this;
+            }
+            SocketPool::add(waker);
+
+            connectionTask = loop.add(&NetworkThread::tickConnection, this);
+            inputTask = loop.add(&NetworkThread::sendInput, this, INT64_MAX);
+        }
+
+        NetworkThread(const NetworkThread&) = delete;
+        NetworkThread& operator=(const NetworkThread&) = delete;
+
+        bool start()
+        {
+            stopRequested = false;
+            return thread.start(&NetworkThread::run, this, PRIORITY);
+        }
+
+        void stop()
+        {
+            stopRequested = true;
+            waker.wake();
+            thread.join();
+        }
+
+        // How often the producer should sample the controller
+        int64_t gamepadSampleIntervalNs() const
+        {
+            return gamepadStreams[0].streamer.sampleIntervalNs();
+        }
+
+        // Producer side, from one thread. Push a controller's state (by id) when it changes, the network
+        // thread takes care of rate limiting and keepalives. A state with user ControllerTable::NO_USER
+        // means the controller left. Returns false if the queue is full.
+        bool sendGamepad(GamepadPacket &&packet)
+        {
+            bool queued = gamepads.push(std::move(packet));
+            waker.wake();
+            return queued;
+        }
+
+        // Producer side, from one thread. The command is resent until the robot acks it.
+        // Returns false if the queue is full or the command is too large to encode.
+        bool sendCommand(Command &&command)
+        {
+            if (!command.isValid())
+            {
+                return false;
+            }
+
+            bool queued = commandQueue.push(std::move(command));
+            waker.wake();
+            return queued;
+        }
+
+        // Consumer side, from one thread. A received packet's datagram, ready to parse.
+        bool popReceived(FixedBuf &datagram)
+        {
+            return inbox.pop(datagram);
+        }
+
+        // Consumer side, from one thread. Returns the newest status if any were published.
+        bool popStatus(LinkStatus &latest)
+        {
+            bool any = false;
+            while (status.pop(latest))
+            {
+                any = true;
+            }
+            return any;
+        }
+
+        ~NetworkThread()
+        {
+            stop();
+
+            for (GamepadStream &stream : gamepadStreams)
+            {
+                connection.timers.cancel(stream.timer);
+            }
+        }
+
+    private:
+        static void run(void *ctx)
+        {
+            NetworkThread &self = *(NetworkThread *)ctx;
+
+            while (!self.stopRequested.load(std::memory_order_acquire))
+            {
+                self.loop.runOnce();
+
+                // Received packets can schedule timers, like the first heartbeat after connecting
+                self.loop.wake(self.connectionTask, self.connection.nextDeadlineNs());
+            }
+        }
+
+        static void onWake(void *ctx)
+        {
+            NetworkThread &self = *(NetworkThread *)ctx;
+            self.loop.wake(self.inputTask);
+        }
+
+        static int64_t tickConnection(void *ctx, int64_t now)
+        {
+            NetworkThread &self = *(NetworkThread *)ctx;
+            self.connection.tick(0);
+
+            const RttEstimator &latency = self.connection.latency;
+
+            LinkStatus link;
+            link.atNs = now;
+            link.state = self.connection.link.getState();
+            link.rttNs = latency.smoothedRttNs();
+            link.minRttNs = latency.minRttNs();
+            link.jitterNs = latency.rttJitterNs();
+            link.clockOffsetNs = latency.clockOffsetNs();
+            link.lostHeartbeats = latency.lostCount();
+            link.droppedWrites = self.connection.sock.droppedWrites.load(std::memory_order_relaxed);
+            self.status.push(std::move(link));
+
+            return self.connection.nextDeadlineNs();
+        }
+
+        // Send a controller's state if it is due and set its timer for the next send
+        void pollStream(GamepadStream &stream, int64_t now)
+        {
+            int64_t next = stream.streamer.poll(now, [&](GamepadPacket &state)
+            {
+                connection.sendPacket(state);
+            });
+
+            if (next == INT64_MAX)
+            {
+                connection.timers.cancel(stream.timer);
+            }
+            else
+            {
+                connection.timers.schedule(stream.timer, next);
+            }
+        }
+
+        // Keepalives and rate-limited changes, run from the connection's timer wheel
+        static void onStreamDue(void *ctx, int64_t nowNs)
+        {
+            GamepadStream &stream = *(GamepadStream *)ctx;
+            stream.owner->pollStream(stream, nowNs);
+        }
+
+        // Runs when woken by a producer
+        // Every controller with a change due goes out in this one pass, and the socket sends them
+        // together on its next POLLOUT. Later sends are left on the connection's timers.
+        static int64_t sendInput(void *ctx, int64_t now)
+        {
+            NetworkThread &self = *(NetworkThread *)ctx;
+
+            // Only the newest state of each controller matters, older ones are coalesced away
+            GamepadPacket packet;
+            while (self.gamepads.pop(packet))
+            {
+                if (packet.id < 0 || (size_t)packet.id >= ControllerTable::MAX_CONTROLLERS)
+                {
+                    continue;
+                }
+
+                GamepadStreamer &stream = self.gamepadStreams[packet.id].streamer;
+                if (packet.user != ControllerTable::NO_USER)
+                {
+                    stream.offer(packet);
+                }
+                else if (const GamepadPacket *last = stream.current())
+                {
+                    // Leave the robot with the controller at rest rather than its last input
+                    GamepadPacket rest;
+                    rest.id = last->id;
+                    rest.user = last->user;
+                    rest.takeSequenceNum();
+                    self.connection.sendPacket(rest);
+                    stream.clear();
+                }
+            }
+
+            Command command;
+            while (self.commandQueue.pop(command))
+            {
+                self.connection.sendCommand(std::move(command));
+            }
+
+            for (GamepadStream &stream : self.gamepadStreams)
+            {
+                self.pollStream(stream, now);
+            }
+
+            // Whatever was scheduled may be due before the connection task's deadline
+            self.loop.wake(self.connectionTask, self.connection.nextDeadlineNs());
+            return INT64_MAX;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_NETWORKTHREAD_H)
@@ -0,0 +1,181 @@
+#if !defined(LIBROBOCOL_ROBOCOL_PEERLINK_H)
+#define LIBROBOCOL_ROBOCOL_PEERLINK_H
+
+#include <cstdint>
+#include <algorithm>
+
+#include "log.h"
+#include "TimerWheel.h"
+
+namespace librobocol
+{
+    // Whether the robot is there, and finding it again when it isn't
+    // We start out DISCOVERING, sending PeerDiscovery until the robot answers. Anything heard from the
+    // robot makes us CONNECTED, and hearing nothing for TIMEOUT_NS makes us LOST, which goes back to
+    // sending PeerDiscovery. Retries back off from RETRY_MIN_NS to RETRY_MAX_NS, so a robot that is
+    // off costs a few datagrams a second, and one that reboots is found within RETRY_MAX_NS of
+    // coming back.
+    class PeerLink
+    {
+    public:
+        enum class State : uint8_t
+        {
+            DISCOVERING, // Never heard from the robot
+            CONNECTED,
+            LOST // Heard from it before, but not lately
+        };
+
+        static constexpr int64_t RETRY_MIN_NS = 50'000'000;
+        static constexpr int64_t RETRY_MAX_NS = 400'000'000;
+        static constexpr int64_t TIMEOUT_NS = 500'000'000; // Five missed heartbeat replies
+
+        // Puts a PeerDiscovery on the wire
+        using SendFn = void (*)(void *ctx);
+
+        // Called after the state changes
+        using ChangeFn = void (*)(void *ctx, State state, int64_t nowNs);
+
+        struct Stats
+        {
+            size_t discoveriesSent = 0;
+            size_t connects = 0;
+            size_t losses = 0;
+        };
+
+    private:
+        TimerWheel &timers;
+        Timer retryTimer;
+        Timer timeoutTimer;
+
+        State state = State::DISCOVERING;
+        int64_t retryNs = RETRY_MIN_NS; // Wait before the next retry
+        int64_t lastHeardNs = 0;
+
+        SendFn sendFn;
+        ChangeFn changeFn;
+        void *ctx;
+
+        Stats stats;
+
+        void setState(State next, int64_t nowNs)
+        {
+            if (state == next)
+            {
+                return;
+            }
+
+            LOG_INFO("Robot link %s -> %s\n", stateName(state), stateName(next));
+            state = next;
+            if (changeFn != nullptr)
+            {
+                changeFn(ctx, state, nowNs);
+            }
+        }
+
+        void beginDiscovery(int64_t nowNs)
+        {
+            timers.cancel(timeoutTimer);
+            retryNs = RETRY_MIN_NS;
+            onRetry(this, nowNs);
+        }
+
+        static void onRetry(void *ctx, int64_t nowNs)
+        {
+            PeerLink &self = *(PeerLink *)ctx;
+
+            self.stats.discoveriesSent++;
+            self.sendFn(self.ctx);
+
+            self.timers.schedule(self.retryTimer, nowNs + self.retryNs);
+            self.retryNs = std::min(self.retryNs * 2, RETRY_MAX_NS);
+        }
+
+        // Hearing from the robot only records the time, and this checks it when the timeout would be up
+        static void onTimeout(void *ctx, int64_t nowNs)
+        {
+            PeerLink &self = *(PeerLink *)ctx;
+
+            int64_t expiresNs = self.lastHeardNs + TIMEOUT_NS;
+            if (nowNs < expiresNs)
+            {
+                self.timers.schedule(self.timeoutTimer, expiresNs);
+                return;
+            }
+
+            self.stats.losses++;
+            self.setState(State::LOST, nowNs);
+            self.beginDiscovery(nowNs);
+        }
+
+    public:
+        PeerLink(TimerWheel &timers, SendFn sendFn, ChangeFn changeFn, void *ctx) :
+            timers(timers), retryTimer(&PeerLink::onRetry, this), timeoutTimer(&PeerLink::onTimeout, this),
+            sendFn(sendFn), changeFn(changeFn), ctx(ctx)
+        {}
+
+        PeerLink(const PeerLink&) = delete;
+        PeerLink& operator=(const PeerLink&) = delete;
+
+        // Start looking for the robot
+        void start(int64_t nowNs)
+        {
+            setState(State::DISCOVERING, nowNs);
+            beginDiscovery(nowNs);
+        }
+
+        // The robot answered a PeerDiscovery or a heartbeat
+        void onHeard(int64_t nowNs)
+        {
+            lastHeardNs = nowNs;
+            if (state == State::CONNECTED)
+            {
+                return;
+            }
+
+            timers.cancel(retryTimer);
+            timers.schedule(timeoutTimer, nowNs + TIMEOUT_NS);
+
+            stats.connects++;
+            setState(State::CONNECTED, nowNs);
+        }
+
+        State getState() const
+        {
+            return state;
+        }
+
+        bool isConnected() const
+        {
+            return state == State::CONNECTED;
+        }
+
+        int64_t getLastHeardNs() const
+        {
+            return lastHeardNs;
+        }
+
+        const Stats &getStats() const
+        {
+            return stats;
+        }
+
+        static const char *stateName(State state)
+        {
+            switch (state)
+            {
+            case State::DISCOVERING: return "discovering";
+            case State::CONNECTED: return "connected";
+            case State::LOST: return "lost";
+            }
+            return "?";
+        }
+
+        ~PeerLink()
+        {
+            timers.cancel(retryTimer);
+            timers.cancel(timeoutTimer);
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_PEERLINK_H)
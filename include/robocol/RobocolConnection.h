@@ -5,12 +5,19 @@
 
 #include "UdpSocket.h"
 #include "SocketPool.h"
+#include "SpscRing.h"
 #include "packet.h"
+#include "RttEstimator.h"
+#include "TimerWheel.h"
+#include "CommandChannel.h"
+#include "PeerLink.h"
 
 namespace librobocol
 {
     class RobocolConnection;
-    PacketProcessor<RobocolConnection>* getRobocolPacketProcessor();
+
+    // Hand a received datagram to the robocol handlers, defined with them in handlers.h
+    void dispatchRobocolDatagram(RobocolConnection *connection, FixedBuf &datagram);
 
     class RobocolConnection
     {
@@ -20,10 +27,36 @@ namespace librobocol
         // IP chosen by a REV Robot Controller when it hosts its own network - not WIFI Direct
         constexpr static const char *ROBOCOL_ROBOT_IP_DEFAULT = "192.168.43.1"; // CUSTOMIZE IN MAIN
         constexpr static uint16_t ROBOCOL_PORT_DEFAULT = 20884;
+        constexpr static int64_t HEARTBEAT_INTERVAL_NS = 100'000'000;
+
+        // Smallest packet sent in pieces. Below this, copying it into one buffer is cheaper than the
+        // kernel walking an iovec. libogc copies every send into an IOS buffer anyway, so the Wii never does.
+#ifdef GEKKO
+        constexpr static size_t GATHER_MIN_SIZE = SIZE_MAX;
+#else
+        constexpr static size_t GATHER_MIN_SIZE = 1024;
+#endif
 
         // UDP connection socket with robot
         UdpSocket sock;
 
+        // Retransmits and other timed work, advanced by tick()
+        TimerWheel timers;
+
+        // Commands we send are retried until acked, commands we receive are acked and deduplicated
+        CommandChannel commands;
+
+        // Round trip time and clock offset to the robot, fed by heartbeat replies
+        RttEstimator latency;
+
+        // Discovery and reconnection. Heartbeats only go out while connected.
+        PeerLink link;
+        Timer heartbeatTimer;
+
+        // Received packets the application wants, as shares of their datagrams. Null to drop them.
+        SpscRing<FixedBuf> *inbox = nullptr;
+        size_t droppedDeliveries = 0;
+
         //WriteQueue writeQueue;
 
         // Create default connection to robot
@@ -31,8 +64,14 @@ namespace librobocol
             RobocolConnection(ROBOCOL_ROBOT_IP_DEFAULT, ROBOCOL_PORT_DEFAULT)
             {}
 
-        RobocolConnection(const char *robotIpStr, uint16_t port = 20884) : 
-            sock(port, robotIpStr, std::bind(&PacketProcessor<RobocolConnection>::process, getRobocolPacketProcessor(), this, std::placeholders::_1, std::placeholders::_2))
+        // localPort is UdpSocket::SAME_PORT for a real robot, which replies to the port it hears from.
+        // A host tool talking to a simulator on the same machine passes UdpSocket::EPHEMERAL_PORT.
+        RobocolConnection(const char *robotIpStr, uint16_t port = 20884, int localPort = UdpSocket::SAME_PORT) : 
+            sock(port, robotIpStr, &RobocolConnection::onDatagram, this, localPort),
+            timers(currentTimeNs()),
+            commands(timers, &RobocolConnection::sendCommandNow, this),
+            link(timers, &RobocolConnection::sendPeerStatusNow, &RobocolConnection::onLinkChange, this),
+            heartbeatTimer(&RobocolConnection::onHeartbeatDue, this)
         {
             SocketPool::add(sock);
             init();
@@ -40,7 +79,7 @@ namespace librobocol
 
         void init()
         {
-            sendPeerStatus();
+            link.start(currentTimeNs());
         }
 
         void sendPeerStatus()
@@ -57,37 +96,172 @@ namespace librobocol
             // if (ret < 0) { printf("Got error with sendto %d", errno); }
         }
 
+        static void sendPeerStatusNow(void *ctx)
+        {
+            ((RobocolConnection *)ctx)->sendPeerStatus();
+        }
+
         template <typename T>
         void sendPacket(T &packet)
         {
-            printf("Going to write packet of type %s\n", typeid(packet).name());
+            LOG_TRACE("Going to write packet of type %s\n", typeid(packet).name());
+
+            // Packets that can be too large to encode say so rather than being wrapped or cut short
+            if constexpr (requires { packet.isValid(); })
+            {
+                if (!packet.isValid())
+                {
+                    LOG_WARN("Dropping a packet that can't be encoded\n");
+                    return;
+                }
+            }
+
+            // Packets with large strings send them from where they are rather than copying them
+            if constexpr (requires(GatherBuf &out) { packet.gather(out); })
+            {
+                if ((size_t)packet.getSize() >= GATHER_MIN_SIZE)
+                {
+                    GatherBuf datagram;
+                    size_t written = packet.gather(datagram);
+                    sock.write(std::move(datagram));
+                    LOG_TRACE("Wrote gathered packet, size %u\n", (unsigned)written);
+                    return;
+                }
+            }
+
             FixedBuf writeBuf = BufCache::getBuf(packet.getSize());
+            if (!writeBuf.isValid())
+            {
+                LOG_WARN("Packet of size %u is too large to send\n", (unsigned)packet.getSize());
+                return;
+            }
             size_t written = packet.serialize(writeBuf.begin());
             sock.write(std::move(writeBuf));
-            printf("Wrote packet, size %d\n", written);
+            LOG_TRACE("Wrote packet, size %u\n", (unsigned)written);
         }
 
         void tick(int64_t delta)
         {
             sock.tick(delta);
+
+            timers.advance(currentTimeNs());
+        }
+
+        // When tick() next has work to do
+        int64_t nextDeadlineNs() const
+        {
+            return timers.nextExpiryNs();
+        }
+
+        // Send a command, resending it until the robot acks it. Returns false if too many are waiting
+        // or it is too large to encode.
+        bool sendCommand(Command &&command)
+        {
+            return commands.send(std::move(command), currentTimeNs());
+        }
+
+        static void sendCommandNow(void *ctx, Command &command)
+        {
+            ((RobocolConnection *)ctx)->sendPacket(command);
+        }
+
+        void sendHeartbeat(int64_t now)
+        {
+            Heartbeat packet = Heartbeat::forTimeSync(now);
+            latency.onSent(packet.getSequenceNum(), now);
+            sendPacket(packet);
+        }
+
+        static void onHeartbeatDue(void *ctx, int64_t nowNs)
+        {
+            RobocolConnection &self = *(RobocolConnection *)ctx;
+            self.sendHeartbeat(nowNs);
+            self.timers.schedule(self.heartbeatTimer, nowNs + HEARTBEAT_INTERVAL_NS);
+        }
+
+        static void onLinkChange(void *ctx, PeerLink::State state, int64_t nowNs)
+        {
+            RobocolConnection &self = *(RobocolConnection *)ctx;
+            if (state == PeerLink::State::CONNECTED)
+            {
+                self.timers.schedule(self.heartbeatTimer, nowNs);
+            }
+            else
+            {
+                self.timers.cancel(self.heartbeatTimer);
+            }
+        }
+
+        // The robot echoes our heartbeats with t1 and t2 filled in
+        void onHeartbeat(const Heartbeat &packet)
+        {
+            int64_t now = currentTimeNs();
+            if (!latency.onReply(packet.getSequenceNum(), packet.getT1Ns(), packet.getT2Ns(), now))
+            {
+                LOG_TRACE("Heartbeat %u was not one of ours\n", (unsigned)packet.getSequenceNum());
+            }
+            link.onHeard(now);
+        }
+
+        // The robot answers our PeerDiscovery with its own
+        void onPeerDiscovery(const PeerDiscovery &packet)
+        {
+            if (packet.getPeerType() == PeerType::NOT_CONNECTED_DUE_TO_PREEXISTING_CONNECTION)
+            {
+                LOG_WARN("Robot is already connected to another driver station\n");
+                return;
+            }
+            link.onHeard(currentTimeNs());
+        }
+
+        // Hand a parsed packet's datagram on to the application
+        void deliver(FixedBuf &datagram)
+        {
+            if (inbox == nullptr)
+            {
+                return;
+            }
+
+            FixedBuf shared = datagram.share();
+            if (!inbox->push(std::move(shared)))
+            {
+                droppedDeliveries++;
+            }
+        }
+
+        // Smoothed round trip time to the robot, 0 before the first heartbeat reply
+        int64_t rttNs() const
+        {
+            return latency.smoothedRttNs();
+        }
+
+        // Robot clock minus ours
+        int64_t clockOffsetNs() const
+        {
+            return latency.clockOffsetNs();
+        }
+
+        static void onDatagram(void *ctx, FixedBuf &datagram)
+        {
+            dispatchRobocolDatagram((RobocolConnection *)ctx, datagram);
         }
 
         // Do something with a deserialized packet
         template <typename PacketT>
         void handle(PacketT &packet)
         {
-            printf("USING WRONG PROTOTYPE FOR PACKETT %s\n", typeid(packet).name());
+            LOG_WARN("USING WRONG PROTOTYPE FOR PACKETT %s\n", typeid(packet).name());
         }
 
         template <typename PacketT>
         void handle(Command &packet)
         {
-            printf("Looking at a command\n");
+            LOG_DEBUG("Looking at a command\n");
         }
 
         ~RobocolConnection()
         {
-            
+            timers.cancel(heartbeatTimer);
         }
 
         // Get the type of a packet without advancing the iterator
@@ -0,0 +1,195 @@
+#if !defined(LIBROBOCOL_ROBOCOL_RTTESTIMATOR_H)
+#define LIBROBOCOL_ROBOCOL_RTTESTIMATOR_H
+
+#include <array>
+#include <cstdint>
+#include <algorithm>
+
+#include "log.h"
+
+namespace librobocol
+{
+    // Round trip time and robot clock offset, measured from heartbeats the robot echoes back
+    // Each exchange gives four times, as in NTP:
+    //   t0 we send, t1 the robot receives, t2 the robot replies, t3 we receive
+    //   rtt = (t3 - t0) - (t2 - t1)
+    //   offset = ((t1 - t0) + (t2 - t3)) / 2, the robot's clock minus ours
+    // A sample delayed by queueing has a long rtt and an offset skewed by up to half of the extra delay,
+    // so the offset reported is the one from the lowest rtt sample in the last WINDOW samples.
+    class RttEstimator
+    {
+    public:
+        static constexpr size_t WINDOW = 16; // Samples the minimum rtt and offset are taken over
+        static constexpr size_t PENDING = 8; // Heartbeats that can be waiting for a reply at once
+
+        // Called when the smoothed rtt crosses the alert threshold, in either direction
+        using AlertFn = void (*)(void *ctx, const RttEstimator &estimator, bool degraded);
+
+        struct Sample
+        {
+            int64_t rttNs = 0;
+            int64_t offsetNs = 0;
+            int64_t atNs = 0; // Local time the reply arrived
+        };
+
+    private:
+        struct Pending
+        {
+            uint16_t seq = 0;
+            bool waiting = false;
+            int64_t sentNs = 0;
+        };
+
+        std::array<Pending, PENDING> pending;
+        std::array<Sample, WINDOW> window;
+        size_t windowNext = 0;
+
+        Sample last;
+        Sample best; // Lowest rtt in the window
+
+        int64_t srttNs = 0; // Smoothed rtt, gain 1/8 as in RFC 6298
+        int64_t rttVarNs = 0; // Smoothed mean deviation from srtt, gain 1/4
+        int64_t jitterNs = 0; // Smoothed change between consecutive rtts, gain 1/16 as in RFC 3550
+
+        size_t samples = 0;
+        size_t lost = 0; // Heartbeats that were never answered
+
+        int64_t alertThresholdNs = 0;
+        AlertFn alertFn = nullptr;
+        void *alertCtx = nullptr;
+        bool degraded = false;
+
+    public:
+        // Remember when a heartbeat left so its reply can be timed locally in nanoseconds
+        void onSent(uint16_t seq, int64_t nowNs)
+        {
+            Pending &slot = pending[seq % PENDING];
+            if (slot.waiting)
+            {
+                lost++;
+            }
+
+            slot.seq = seq;
+            slot.waiting = true;
+            slot.sentNs = nowNs;
+        }
+
+        // A reply to heartbeat seq arrived at nowNs. robotRecvNs and robotSendNs are t1 and t2 in the
+        // robot's clock. Returns false if we have no record of sending it.
+        bool onReply(uint16_t seq, int64_t robotRecvNs, int64_t robotSendNs, int64_t nowNs)
+        {
+            Pending &slot = pending[seq % PENDING];
+            if (!slot.waiting || slot.seq != seq)
+            {
+                return false;
+            }
+            slot.waiting = false;
+
+            int64_t t0 = slot.sentNs;
+            int64_t t3 = nowNs;
+
+            Sample sample;
+            sample.rttNs = std::max<int64_t>((t3 - t0) - (robotSendNs - robotRecvNs), 0);
+            sample.offsetNs = ((robotRecvNs - t0) + (robotSendNs - t3)) / 2;
+            sample.atNs = nowNs;
+
+            addSample(sample);
+            return true;
+        }
+
+        void addSample(const Sample &sample)
+        {
+            if (samples == 0)
+            {
+                srttNs = sample.rttNs;
+                rttVarNs = sample.rttNs / 2;
+            }
+            else
+            {
+                int64_t err = sample.rttNs - srttNs;
+                rttVarNs += ((err < 0 ? -err : err) - rttVarNs) / 4;
+                srttNs += err / 8;
+
+                int64_t change = sample.rttNs - last.rttNs;
+                jitterNs += ((change < 0 ? -change : change) - jitterNs) / 16;
+            }
+
+            last = sample;
+            samples++;
+
+            window[windowNext] = sample;
+            windowNext = (windowNext + 1) % WINDOW;
+
+            size_t filled = std::min(samples, WINDOW);
+            best = window[0];
+            for (size_t i = 1; i < filled; i++)
+            {
+                if (window[i].rttNs < best.rttNs)
+                {
+                    best = window[i];
+                }
+            }
+
+            checkAlert();
+        }
+
+        // Report when srtt goes above thresholdNs, and again once it has come back below 3/4 of it
+        void setAlert(int64_t thresholdNs, AlertFn fn = nullptr, void *ctx = nullptr)
+        {
+            alertThresholdNs = thresholdNs;
+            alertFn = fn;
+            alertCtx = ctx;
+            degraded = false;
+        }
+
+        bool hasSample() const { return samples > 0; }
+        size_t sampleCount() const { return samples; }
+        size_t lostCount() const { return lost; }
+        bool isDegraded() const { return degraded; }
+
+        int64_t lastRttNs() const { return last.rttNs; }
+        int64_t minRttNs() const { return best.rttNs; }
+        int64_t smoothedRttNs() const { return srttNs; }
+        int64_t rttVarianceNs() const { return rttVarNs; }
+        int64_t rttJitterNs() const { return jitterNs; }
+
+        // Robot clock minus local clock, from the lowest rtt sample in the window
+        int64_t clockOffsetNs() const { return best.offsetNs; }
+
+        // A local currentTimeNs() value in the robot's clock
+        int64_t toRobotTimeNs(int64_t localNs) const { return localNs + best.offsetNs; }
+
+    private:
+        void checkAlert()
+        {
+            if (alertThresholdNs <= 0)
+            {
+                return;
+            }
+
+            bool nowDegraded = degraded ? srttNs > alertThresholdNs * 3 / 4 : srttNs > alertThresholdNs;
+            if (nowDegraded == degraded)
+            {
+                return;
+            }
+            degraded = nowDegraded;
+
+            if (degraded)
+            {
+                LOG_WARN("Robot latency degraded, srtt %d us min %d us jitter %d us\n",
+                    (int)(srttNs / 1000), (int)(best.rttNs / 1000), (int)(jitterNs / 1000));
+            }
+            else
+            {
+                LOG_INFO("Robot latency recovered, srtt %d us\n", (int)(srttNs / 1000));
+            }
+
+            if (alertFn != nullptr)
+            {
+                alertFn(alertCtx, *this, degraded);
+            }
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_RTTESTIMATOR_H)
@@ -0,0 +1,184 @@
+#if !defined(LIBROBOCOL_ROBOCOL_TELEMETRYTABLE_H)
+#define LIBROBOCOL_ROBOCOL_TELEMETRYTABLE_H
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+#include "packet.h"
+
+namespace librobocol
+{
+    // The robot's latest telemetry, by key
+    // An open-addressed table with linear probing. The robot sends the same keys in packet after
+    // packet, so a key keeps its entry and its strings keep their storage, and an update that changes
+    // nothing allocates nothing. Every update() bumps the table's generation, and an entry remembers the
+    // generation its value last changed in, so a display can redraw just the entries that changed since
+    // it last drew. Keys are never removed, only marked as missing from the latest packet.
+    class TelemetryTable
+    {
+    public:
+        static constexpr size_t CAPACITY = 128; // Most keys kept, a power of two
+        static constexpr size_t MAX_KEYS = CAPACITY * 3 / 4; // Keeps probes short
+
+        struct Entry
+        {
+            std::string key;
+            std::string text; // String entries
+            float number = 0; // Number entries
+            bool isNumber = false;
+
+            uint8_t order = 0; // When the key was first seen, for a stable display order
+            uint32_t changedIn = 0; // Generation the value last changed in
+            uint32_t seenIn = 0; // Generation the key was last sent in
+
+            bool used() const
+            {
+                return changedIn != 0;
+            }
+        };
+
+    private:
+        std::array<Entry, CAPACITY> entries;
+        size_t keyCount = 0;
+        size_t droppedKeys = 0; // Not stored because the table was full
+
+        uint32_t generation = 0;
+        int64_t timestamp = 0;
+        RobotState robotState = RobotState::UNKNOWN;
+        std::string tag;
+
+        static uint32_t hash(std::string_view key)
+        {
+            // FNV-1a
+            uint32_t h = 2166136261u;
+            for (char c : key)
+            {
+                h = (h ^ (uint8_t)c) * 16777619u;
+            }
+            return h;
+        }
+
+        // The key's entry, claimed if it is new. Null if the table is full.
+        Entry *find(std::string_view key)
+        {
+            for (size_t i = hash(key) & (CAPACITY - 1);; i = (i + 1) & (CAPACITY - 1))
+            {
+                Entry &entry = entries[i];
+                if (!entry.used())
+                {
+                    if (keyCount >= MAX_KEYS)
+                    {
+                        droppedKeys++;
+                        return nullptr;
+                    }
+
+                    entry.key.assign(key);
+                    entry.order = (uint8_t)keyCount++;
+                    entry.changedIn = generation;
+                    return &entry;
+                }
+
+                if (entry.key == key)
+                {
+                    return &entry;
+                }
+            }
+        }
+
+    public:
+        // Take in a telemetry packet
+        void update(const Telemetry &packet)
+        {
+            generation++;
+            timestamp = packet.timestamp;
+            robotState = packet.robotState;
+            if (tag != packet.tag)
+            {
+                tag.assign(packet.tag);
+            }
+
+            packet.forEachString([&](std::string_view key, std::string_view value)
+            {
+                Entry *entry = find(key);
+                if (entry == nullptr)
+                {
+                    return;
+                }
+
+                entry->seenIn = generation;
+                if (entry->isNumber || entry->text != value)
+                {
+                    entry->text.assign(value);
+                    entry->isNumber = false;
+                    entry->changedIn = generation;
+                }
+            });
+
+            packet.forEachNumber([&](std::string_view key, float value)
+            {
+                Entry *entry = find(key);
+                if (entry == nullptr)
+                {
+                    return;
+                }
+
+                entry->seenIn = generation;
+                if (!entry->isNumber || entry->number != value)
+                {
+                    entry->number = value;
+                    entry->isNumber = true;
+                    entry->changedIn = generation;
+                }
+            });
+        }
+
+        // Call fn(const Entry&) for every entry that changed after generation since. Pass what
+        // getGeneration() returned at the last redraw, or 0 for everything.
+        template <typename FuncT>
+        void forEachChangedSince(uint32_t since, FuncT fn) const
+        {
+            for (const Entry &entry : entries)
+            {
+                if (entry.used() && entry.changedIn > since)
+                {
+                    fn(entry);
+                }
+            }
+        }
+
+        const Entry *get(std::string_view key) const
+        {
+            for (size_t i = hash(key) & (CAPACITY - 1);; i = (i + 1) & (CAPACITY - 1))
+            {
+                const Entry &entry = entries[i];
+                if (!entry.used())
+                {
+                    return nullptr;
+                }
+
+                if (entry.key == key)
+                {
+                    return &entry;
+                }
+            }
+        }
+
+        // Whether the robot still sent a key in its latest packet
+        bool isCurrent(const Entry &entry) const
+        {
+            return entry.seenIn == generation;
+        }
+
+        uint32_t getGeneration() const { return generation; }
+        size_t size() const { return keyCount; }
+        size_t getDroppedKeys() const { return droppedKeys; }
+
+        int64_t getTimestamp() const { return timestamp; }
+        RobotState getRobotState() const { return robotState; }
+        const std::string &getTag() const { return tag; }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_TELEMETRYTABLE_H)
@@ -1,18 +1,18 @@
 #if !defined(LIBROBOCOL_ROBOCOL_HANDLERS_H)
 #define LIBROBOCOL_ROBOCOL_HANDLERS_H
 
-#include <memory>
-
 #include "PacketProcessor.h"
 #include "packet.h"
 #include "RobocolConnection.h"
 
 namespace librobocol
 {
-    class CommandHandler : public PacketHandler<RobocolConnection>
+    class CommandHandler
     {
     public:
-        void sendAck(Command &command, RobocolConnection& connection)
+        static constexpr MsgType TYPE = MsgType::COMMAND;
+
+        static void sendAck(Command &command, RobocolConnection& connection)
         {
             Command ack = command;
             ack.acknowledged = true;
@@ -20,39 +20,104 @@ namespace librobocol
             connection.sendPacket(ack);
         }
 
-        size_t process(RobocolConnection* connection, const char *begin, const char *end)
+        static size_t process(RobocolConnection* connection, FixedBuf &datagram)
         {
             Command packet;
-            packet.parse(begin, end);
+            ParseError err = packet.parse(datagram);
+            if (err != ParseError::NONE)
+            {
+                LOG_WARN("Dropping command: %s\n", parseErrorName(err));
+                return 0;
+            }
+
+            if (packet.acknowledged)
+            {
+                connection->commands.onAck(packet);
+                return datagram.size();
+            }
+
+            // Ack every copy, since a repeat means our last ack was lost, but only pass it on once
+            sendAck(packet, *connection);
+            if (connection->commands.onReceive(packet))
+            {
+                connection->deliver(datagram);
+            }
 
-            //printf("Got command for data %s and %s", packet.name.c_str(), packet.extra.data());
+            return datagram.size();
+        }
+    };
 
-            //connection->handle<Command>(packet);
+    class HeartbeatHandler
+    {
+    public:
+        static constexpr MsgType TYPE = MsgType::HEARTBEAT;
 
-            // Send the acknowledgement back if needed
-            if (packet.acknowledged == false)
+        static size_t process(RobocolConnection* connection, FixedBuf &datagram)
+        {
+            Heartbeat packet;
+            ParseError err = packet.parse(datagram);
+            if (err != ParseError::NONE)
             {
-                packet.acknowledged = false;
-                //FixedBuf ack = BufCache::getBuf(packet.getSize());
-                //packet.serializeForTransmit(ack.begin());
-                //connection->sendPacket(packet);
+                LOG_WARN("Dropping heartbeat: %s\n", parseErrorName(err));
+                return 0;
             }
 
-            return (end - begin);
+            connection->onHeartbeat(packet);
+
+            return datagram.size();
         }
     };
 
-    PacketProcessor<RobocolConnection>* getRobocolPacketProcessor()
+    class PeerDiscoveryHandler
     {
-        static PacketProcessor<RobocolConnection> processor;
+    public:
+        static constexpr MsgType TYPE = MsgType::PEER_DISCOVERY;
 
-        if (processor.packetTypeCount() == 0)
+        static size_t process(RobocolConnection* connection, FixedBuf &datagram)
         {
-            //todo: telemetry
-            processor.addHandler(std::make_unique<CommandHandler>(), MsgType::COMMAND);
+            PeerDiscovery packet = PeerDiscovery::forReceive();
+            ParseError err = packet.parse(datagram);
+            if (err != ParseError::NONE)
+            {
+                LOG_WARN("Dropping peer discovery: %s\n", parseErrorName(err));
+                return 0;
+            }
+
+            connection->onPeerDiscovery(packet);
+
+            return datagram.size();
         }
+    };
 
-        return &processor;
+    class TelemetryHandler
+    {
+    public:
+        static constexpr MsgType TYPE = MsgType::TELEMETRY;
+
+        // Only the header is checked here. The application parses the rest once, as it loads the
+        // packet into its TelemetryTable, so the network thread doesn't decode every key as well.
+        static size_t process(RobocolConnection* connection, FixedBuf &datagram)
+        {
+            ParsedHeader header;
+            ParseError err = parseHeader(datagram.data(), datagram.size(), header);
+            if (err != ParseError::NONE)
+            {
+                LOG_WARN("Dropping telemetry: %s\n", parseErrorName(err));
+                return 0;
+            }
+
+            connection->deliver(datagram);
+
+            return datagram.size();
+        }
+    };
+
+    using RobocolPacketProcessor = PacketProcessor<RobocolConnection,
+        CommandHandler, HeartbeatHandler, PeerDiscoveryHandler, TelemetryHandler>;
+
+    void dispatchRobocolDatagram(RobocolConnection *connection, FixedBuf &datagram)
+    {
+        RobocolPacketProcessor::process(connection, datagram);
     }
 }
 
@@ -0,0 +1,151 @@
+#if !defined(LIBROBOCOL_ROBOCOL_LAYOUT_H)
+#define LIBROBOCOL_ROBOCOL_LAYOUT_H
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <bit>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+
+#include "FixedBuf.h"
+
+#ifndef BIGENDIAN
+#define BIGENDIAN 0
+#define LITTLEENDIAN 1
+#endif
+
+#if defined(PPC)
+#define HOST_ENDIAN BIGENDIAN
+#else
+#define HOST_ENDIAN LITTLEENDIAN
+#endif
+#define NETWORK_ENDIAN BIGENDIAN
+
+namespace librobocol
+{
+    // Unsigned integer with the same width as T, used to move T's bits around
+    template <size_t Size> struct WireBits;
+    template <> struct WireBits<1> { using type = uint8_t; };
+    template <> struct WireBits<2> { using type = uint16_t; };
+    template <> struct WireBits<4> { using type = uint32_t; };
+    template <> struct WireBits<8> { using type = uint64_t; };
+
+    template <typename T>
+    constexpr T byteswap(T u)
+    {
+        if constexpr (sizeof(T) == 1) { return u; }
+        else if constexpr (sizeof(T) == 2) { return __builtin_bswap16(u); }
+        else if constexpr (sizeof(T) == 4) { return __builtin_bswap32(u); }
+        else { return __builtin_bswap64(u); }
+    }
+
+    // Write val at out in network byte order. One load, at most one bswap, one store.
+    template <typename T>
+    inline void storeNet(char *out, T val)
+    {
+        using BitsT = typename WireBits<sizeof(T)>::type;
+
+        BitsT bits = std::bit_cast<BitsT>(val);
+        if constexpr (HOST_ENDIAN != NETWORK_ENDIAN)
+        {
+            bits = byteswap(bits);
+        }
+        memcpy(out, &bits, sizeof(bits));
+    }
+
+    // Read a T in network byte order from in
+    template <typename T>
+    inline T loadNet(const char *in)
+    {
+        using BitsT = typename WireBits<sizeof(T)>::type;
+
+        BitsT bits;
+        memcpy(&bits, in, sizeof(bits));
+        if constexpr (HOST_ENDIAN != NETWORK_ENDIAN)
+        {
+            bits = byteswap(bits);
+        }
+        return std::bit_cast<T>(bits);
+    }
+
+    // Contiguous memory that output iterators point at, so a layout can be written with plain stores
+    inline char *outputPointer(char *out) { return out; }
+    inline char *outputPointer(FixedBufItr &out) { return out.getPtr(); }
+
+    template <typename OutT>
+    concept ContiguousOutput = requires(OutT &out) { { outputPointer(out) } -> std::same_as<char *>; };
+
+    // Declarative description of a fixed run of fields on the wire, in order
+    // The size and every field offset are known at compile time, so store() unrolls into one store per
+    // field at a constant offset with no branches, instead of emit()'s per-byte loop.
+    template <typename... Fields>
+    struct FixedLayout
+    {
+        static constexpr size_t SIZE = (sizeof(Fields) + ... + 0);
+
+        static constexpr std::array<size_t, sizeof...(Fields)> OFFSETS = []()
+        {
+            std::array<size_t, sizeof...(Fields)> offsets{};
+            size_t sizes[] = {sizeof(Fields)...};
+            size_t offset = 0;
+            for (size_t i = 0; i < sizeof...(Fields); i++)
+            {
+                offsets[i] = offset;
+                offset += sizes[i];
+            }
+            return offsets;
+        }();
+
+        // Write every field to out and advance it past them
+        template <typename OutT>
+        static size_t store(OutT &out, const Fields &...values)
+        {
+            if constexpr (ContiguousOutput<OutT>)
+            {
+                storeAt(outputPointer(out), std::index_sequence_for<Fields...>{}, values...);
+                out += SIZE;
+            }
+            else
+            {
+                char bytes[SIZE];
+                storeAt(bytes, std::index_sequence_for<Fields...>{}, values...);
+                out = std::copy(bytes, bytes + SIZE, out);
+            }
+
+            return SIZE;
+        }
+
+        // Read every field from in, which must have SIZE bytes
+        static void load(const char *in, Fields &...values)
+        {
+            loadAt(in, std::index_sequence_for<Fields...>{}, values...);
+        }
+
+    private:
+        template <size_t... I>
+        static void storeAt(char *out, std::index_sequence<I...>, const Fields &...values)
+        {
+            (storeNet<Fields>(out + OFFSETS[I], values), ...);
+        }
+
+        template <size_t... I>
+        static void loadAt(const char *in, std::index_sequence<I...>, Fields &...values)
+        {
+            ((values = loadNet<Fields>(in + OFFSETS[I])), ...);
+        }
+    };
+
+    // One layout followed by another, so a packet can be described as its header plus its body
+    template <typename FirstT, typename SecondT>
+    struct JoinLayouts;
+
+    template <typename... FirstFields, typename... SecondFields>
+    struct JoinLayouts<FixedLayout<FirstFields...>, FixedLayout<SecondFields...>>
+    {
+        using type = FixedLayout<FirstFields..., SecondFields...>;
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_LAYOUT_H)
@@ -1,29 +1,24 @@
 #if !defined(LIBROBOCOL_ROBOCOL_PACKET_H)
 #define LIBROBOCOL_ROBOCOL_PACKET_H
 
-#include <chrono>
 #include <variant>
 #include <atomic>
 #include <cassert>
 #include <algorithm>
+#include <string>
+#include <string_view>
 #include <time.h>
 
+#include "clock.h"
+#include "FixedBuf.h"
+#include "BufCache.h"
+#include "GatherBuf.h"
+#include "layout.h"
+#include "parse.h"
+
 #ifdef GEKKO
 #include <wiiuse/wpad.h>
-#include <lwp_watchdog.h>
-#endif
-
-#ifndef BIGENDIAN
-#define BIGENDIAN 0
-#define LITTLEENDIAN 1
-#endif
-
-#if defined(PPC)
-#define HOST_ENDIAN BIGENDIAN
-#else
-#define HOST_ENDIAN LITTLEENDIAN
 #endif
-#define NETWORK_ENDIAN BIGENDIAN
 
 namespace librobocol
 {
@@ -34,8 +29,6 @@ namespace librobocol
     constexpr char SDK_MAJOR_VERSION = 8;
     constexpr char SDK_MINOR_VERSION = 0;
 
-    constexpr size_t MAX_PACKET_SIZE = 55000;
-
     enum class RobotState : int8_t
     {
         UNKNOWN = -1,
@@ -86,20 +79,6 @@ namespace librobocol
 
 
 
-    int64_t currentTimeNs()
-    {
-        /*return std::chrono::duration_cast<std::chrono::nanoseconds>(
-                std::chrono::high_resolution_clock::now().time_since_epoch())
-            .count();
-            */
-
-        
-
-        u64 val = ticks_to_nanosecs(gettime());
-        //printf("Got ns %llu\n", val);
-        return val;
-    }
-
     template <typename DataT, typename OutT>
     size_t emit(const DataT &data, OutT &out, int endian = NETWORK_ENDIAN)
     {
@@ -112,7 +91,7 @@ namespace librobocol
 
         if (switchEndian)
         {
-            std::reverse_copy(bytes, bytes + sizeof(DataT), out);
+            out = std::reverse_copy(bytes, bytes + sizeof(DataT), out);
             written = sizeof(DataT);
 
             /*for (auto itr = std::rbegin(bytes); itr != std::rend(bytes); itr++)
@@ -206,6 +185,54 @@ namespace librobocol
     };
     #pragma pack(pop)
 
+    // Fields common to every packet header
+    using HeaderLayout = FixedLayout<
+        MsgType, // type
+        uint16_t, // payload length
+        uint16_t>; // sequence number
+
+    // A datagram's header, once it has been checked against the datagram's size
+    struct ParsedHeader
+    {
+        MsgType type = MsgType::EMPTY;
+        uint16_t payloadLength = 0;
+        uint16_t sequenceNum = 0; // Not set for PeerDiscovery, which carries it in the payload
+        const char *payload = nullptr;
+    };
+
+    // Check that the header's payload length fits in the datagram. This is the only check against
+    // the datagram's size. Everything after it only needs to stay inside payloadLength.
+    inline ParseError parseHeader(const char *data, size_t size, ParsedHeader &header)
+    {
+        if (size < 3)
+        {
+            return ParseError::TRUNCATED;
+        }
+
+        header.type = (MsgType)data[0];
+        header.payloadLength = loadNet<uint16_t>(data + 1);
+
+        // PeerDiscovery predates the sequence number in the header, so its payload starts right after the length
+        size_t headerSize = 3;
+        if (header.type != MsgType::PEER_DISCOVERY)
+        {
+            headerSize = HeaderLayout::SIZE;
+            if (size < headerSize)
+            {
+                return ParseError::TRUNCATED;
+            }
+            header.sequenceNum = loadNet<uint16_t>(data + 3);
+        }
+
+        if (headerSize + header.payloadLength > size)
+        {
+            return ParseError::LENGTH_MISMATCH;
+        }
+
+        header.payload = data + headerSize;
+        return ParseError::NONE;
+    }
+
     class PacketCommon
     {
     public:
@@ -217,36 +244,50 @@ namespace librobocol
     {
     protected:
         uint16_t sequenceNum = 0;
-        int64_t nanotimeTransmit = 0;
-
-        static constexpr long nanotimeTransmitInterval = 200LL * 1000000LL;
 
         Packet(uint16_t sequenceNum)
         {
             this->sequenceNum = sequenceNum;
-            nanotimeTransmit = 0;
         }
 
-        Packet()
+        // Packets start unnumbered, so parse temporaries and cleared slots don't use up sequence
+        // numbers. Ones built to send take the next number with takeSequenceNum().
+        Packet() = default;
+
+    public:
+        // Number this packet with the next sequence number, for one about to go on the wire
+        void takeSequenceNum()
         {
-            this->sequenceNum = PacketCommon::nextSequenceNum++;
-            nanotimeTransmit = 0;
-            assert(PacketCommon::nextSequenceNum < 40000);
+            sequenceNum = PacketCommon::nextSequenceNum++;
         }
 
-        template <typename ItrT>
-        Packet(ItrT &begin, ItrT &end)
+        // Decode a received datagram in one forward pass
+        // The header is checked against the datagram once, then the packet's parseBody() reads its
+        // fixed fields with one size check and checks each variable-length string once. Nothing is
+        // allocated: strings are views into the datagram, which the packet keeps a share of.
+        ParseError parse(FixedBuf &datagram)
         {
-            char type = MsgType::EMPTY;
-            uint16_t payloadLength = 0;
-            sequenceNum = 0;
+            ParsedHeader header;
+            ParseError err = parseHeader(datagram.data(), datagram.size(), header);
+            if (err != ParseError::NONE)
+            {
+                return err;
+            }
+
+            if (header.type != PacketImplT::TYPE)
+            {
+                return ParseError::WRONG_TYPE;
+            }
 
-            read(begin, end, type);
-            read(begin, end, payloadLength);
-            read(begin, end, sequenceNum);
+            PacketReader reader(header.payload, header.payload + header.payloadLength);
+            return ((PacketImplT *)this)->parseBody(reader, header, datagram);
+        }
+
+        uint16_t getSequenceNum() const
+        {
+            return sequenceNum;
         }
 
-    public:
         auto operator<=>(const Packet<PacketImplT> &) const = default;
 
         template <typename OutT>
@@ -260,41 +301,24 @@ namespace librobocol
         {
             return serialize(out);
         }
-
-        template <typename OutT>
-        size_t serializeForTransmit(OutT &out)
-        {
-            size_t written = serialize(out);
-            nanotimeTransmit = currentTimeNs();
-            return written;
-        }
-
-        template <typename OutT>
-        size_t serializeForTransmit(OutT &&out)
-        {
-            size_t written = serialize(out);
-            nanotimeTransmit = currentTimeNs();
-            return written;
-        }
-
-        bool shouldTransmit(long nanotimeNow)
-        {
-            return this->nanotimeTransmit == 0 || (nanotimeNow - this->nanotimeTransmit > nanotimeTransmitInterval);
-        }
     };
     std::atomic_uint16_t PacketCommon::nextSequenceNum = 10000;
 
     class Heartbeat : public Packet<Heartbeat>
     {
-        int64_t timestamp;
+        int64_t timestamp = 0;
         RobotState robotState;
         int64_t t0;
         int64_t t1;
         int64_t t2;
 
-        std::string timeZoneId;
+        // A literal for heartbeats we send, or a view into backing for ones we receive
+        std::string_view timeZoneId;
+        SharedBuf backing;
 
     public:
+        static constexpr MsgType TYPE = MsgType::HEARTBEAT;
+
         Heartbeat()
         {
             timestamp = 0;
@@ -303,32 +327,91 @@ namespace librobocol
             timeZoneId = "America/Chiicago";
         }
 
+        // t0, t1 and t2 are milliseconds on the wire
+        static constexpr int64_t TIME_UNIT_NS = 1'000'000;
+
         static Heartbeat createWithTimeStamp()
         {
             Heartbeat result;
+            result.takeSequenceNum();
             result.timestamp = currentTimeNs();
             return result;
         }
 
+        // A heartbeat for the robot to fill in t1 and t2 and echo back
+        static Heartbeat forTimeSync(int64_t nowNs)
+        {
+            Heartbeat result;
+            result.takeSequenceNum();
+            result.timestamp = nowNs;
+            result.t0 = nowNs / TIME_UNIT_NS;
+            return result;
+        }
+
+        int64_t getTimestamp() const { return timestamp; }
+        RobotState getRobotState() const { return robotState; }
+        int64_t getT0Ns() const { return t0 * TIME_UNIT_NS; }
+        int64_t getT1Ns() const { return t1 * TIME_UNIT_NS; }
+        int64_t getT2Ns() const { return t2 * TIME_UNIT_NS; }
+
+        // The robot's side of a time sync: when it received this heartbeat and when it echoes it
+        void stampRobotTimes(int64_t t1Ns, int64_t t2Ns, RobotState state)
+        {
+            t1 = t1Ns / TIME_UNIT_NS;
+            t2 = t2Ns / TIME_UNIT_NS;
+            robotState = state;
+        }
+
+        // Everything before the time zone string
+        using Body = FixedLayout<
+            int64_t, // timestamp
+            RobotState, // robot state
+            int64_t, // t0
+            int64_t, // t1
+            int64_t, // t2
+            uint8_t>; // time zone length
+        using Layout = JoinLayouts<HeaderLayout, Body>::type;
+
         template <typename OutT>
         size_t serializeImpl(OutT &out)
         {
-            size_t written = 0;
+            size_t payloadLength = Layout::SIZE - 5 + timeZoneId.size();
 
-            size_t payloadLength = 8 + 1 + 8 + 8 + 8 + 1 + timeZoneId.size();
-            written += (PacketHeader{MsgType::HEARTBEAT, (uint16_t)payloadLength, sequenceNum}).emit(out);
+            size_t written = Layout::store(out, MsgType::HEARTBEAT, (uint16_t)payloadLength, sequenceNum,
+                timestamp, robotState, t0, t1, t2, (uint8_t)timeZoneId.size());
 
-            written += emit(timestamp, out);
-            written += emit(robotState, out);
-            written += emit(t0, out);
-            written += emit(t1, out);
-            written += emit(t2, out);
-            written += emit((char)timeZoneId.size(), out);
             out = std::copy(timeZoneId.begin(), timeZoneId.end(), out);
             written += timeZoneId.size();
 
             return written;
         }
+
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
+
+            uint8_t timeZoneLength = 0;
+            reader.take(Body{}, timestamp, robotState, t0, t1, t2, timeZoneLength);
+
+            if (!reader.fits(timeZoneLength))
+            {
+                return ParseError::BAD_STRING;
+            }
+
+            sequenceNum = header.sequenceNum;
+            timeZoneId = reader.takeString(timeZoneLength);
+            backing = datagram.share();
+
+            return ParseError::NONE;
+        }
+
+        size_t getSize()
+        {
+            return Layout::SIZE + timeZoneId.size();
+        }
     };
 
     class PeerDiscovery : public Packet<PeerDiscovery>
@@ -344,6 +427,8 @@ namespace librobocol
         static constexpr int16_t cbPayloadHistorical = 10;
 
     public:
+        static constexpr MsgType TYPE = MsgType::PEER_DISCOVERY;
+
         PeerDiscovery(PeerType peerType, char sdkBuildMonth, short sdkBuildYear, int sdkMajorVersion, int sdkMinorVersion)
         {
             this->peerType = peerType;
@@ -360,7 +445,9 @@ namespace librobocol
 
         static PeerDiscovery forTransmission(PeerType peerType)
         {
-            return PeerDiscovery(peerType, SDK_BUILD_MONTH, SDK_BUILD_YEAR, SDK_MAJOR_VERSION, SDK_MINOR_VERSION);
+            PeerDiscovery result(peerType, SDK_BUILD_MONTH, SDK_BUILD_YEAR, SDK_MAJOR_VERSION, SDK_MINOR_VERSION);
+            result.takeSequenceNum();
+            return result;
         }
 
         //  1 byte    message type
@@ -373,44 +460,72 @@ namespace librobocol
         //  1 byte    major SDK version number (unsigned)
         //  1 byte    minor SDK version number (unsigned)
         //  1 byte    ignored
+        using Body = FixedLayout<
+            char, // ROBOCOL_VERSION
+            PeerType, // peer type
+            uint16_t, // sequence number
+            char, // SDK month
+            int16_t, // SDK year
+            char, // SDK major version
+            char, // SDK minor version
+            char>; // ignored
+        using Layout = JoinLayouts<FixedLayout<MsgType, int16_t>, Body>::type;
+        static_assert(Layout::SIZE == cbBufferHistorical);
+
         template <typename OutT>
         size_t serializeImpl(OutT &out)
         {
-            size_t written = 0;
+            return Layout::store(out, MsgType::PEER_DISCOVERY, cbPayloadHistorical, ROBOCOL_VERSION, peerType,
+                sequenceNum, sdkBuildMonth, sdkBuildYear, (char)sdkMajorVersion, (char)sdkMinorVersion, (char)0);
+        }
+
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
 
-            sequenceNum = 10007;
+            char robocolVersion = 0;
+            char major = 0;
+            char minor = 0;
+            char ignored = 0;
+            reader.take(Body{}, robocolVersion, peerType, sequenceNum, sdkBuildMonth, sdkBuildYear, major, minor, ignored);
 
-            written += emit(MsgType::PEER_DISCOVERY, out);
-            written += emit(cbPayloadHistorical, out);
-            written += emit(ROBOCOL_VERSION, out);
-            written += emit(peerType, out);
-            written += emit(sequenceNum, out);
-            written += emit(sdkBuildMonth, out);
-            written += emit(sdkBuildYear, out);
-            written += emit((char)sdkMajorVersion, out);
-            written += emit((char)sdkMinorVersion, out);
-            written += emit((char)0, out);
+            sdkMajorVersion = (uint8_t)major;
+            sdkMinorVersion = (uint8_t)minor;
 
-            assert(written == 13);
-            return written;
+            return ParseError::NONE;
         }
 
         size_t getSize()
         {
-            return 13;
+            return Layout::SIZE;
+        }
+
+        PeerType getPeerType() const
+        {
+            return peerType;
         }
     };
 
     class Command : public Packet<Command>
     {
     public:
-        std::string name;
-        std::string extra;
-        int64_t timestamp;
+        // Views into backing, which is either the received datagram or a buffer the strings were
+        // copied into when the command was built locally. Copies of the command share backing.
+        std::string_view name;
+        std::string_view extra;
+        SharedBuf backing;
+
+        static constexpr MsgType TYPE = MsgType::COMMAND;
+
+        int64_t timestamp = 0;
         bool acknowledged = false;
         char attempts = 0;
         bool isInjected = false; // not transmitted over network
-        int64_t transmissionDeadlineNs;
+        bool oversized = false; // The strings it was built with didn't fit, so it was left empty
+        int64_t transmissionDeadlineNs = 0;
 
         // space for the timestamp (8 bytes), ack byte (1 byte)
         static constexpr int16_t cbStringLength = 2;
@@ -425,18 +540,54 @@ namespace librobocol
 
         }*/
 
-        Command(std::string &&name, std::string &&extra)
+        // A command to send. One whose name is over 65535 bytes, or that doesn't fit in
+        // MAX_PACKET_SIZE, is left empty instead, and isValid() is false for it.
+        Command(std::string_view name, std::string_view extra)
         {
-            this->name = name;
-            this->extra = extra;
+            if (!fits(name.size(), extra.size()))
+            {
+                oversized = true;
+                return;
+            }
+
+            if (name.size() + extra.size() > 0)
+            {
+                backing = BufCache::getBuf(name.size() + extra.size());
+                char *nameData = backing.data();
+                char *extraData = std::copy(name.begin(), name.end(), nameData);
+                std::copy(extra.begin(), extra.end(), extraData);
+
+                this->name = std::string_view(nameData, name.size());
+                this->extra = std::string_view(extraData, extra.size());
+            }
 
             timestamp = currentTimeNs();
-            sequenceNum = PacketCommon::nextSequenceNum++;
+            takeSequenceNum();
         }
 
         Command() {}
 
-        auto operator<=>(const Command &) const = default;
+        bool operator==(const Command &other) const
+        {
+            return sequenceNum == other.sequenceNum &&
+                timestamp == other.timestamp &&
+                acknowledged == other.acknowledged &&
+                name == other.name &&
+                extra == other.extra;
+        }
+
+        // Whether a command with these strings can be encoded, lengths and all
+        static constexpr bool fits(size_t nameLength, size_t extraLength)
+        {
+            return nameLength <= UINT16_MAX && extraLength <= UINT16_MAX &&
+                5 + cbPayloadBase + 2 * cbStringLength + nameLength + extraLength <= MAX_PACKET_SIZE;
+        }
+
+        // False for a command too large to encode
+        bool isValid() const noexcept
+        {
+            return !oversized && fits(name.size(), extra.size());
+        }
 
         static int getPayloadSize(bool acknowledged, int nameBytesLength, int extraBytesLength)
         {
@@ -455,24 +606,28 @@ namespace librobocol
             return 5 + getPayloadSize(acknowledged, name.size(), extra.size());
         }
 
+        // Everything before the name string
+        using Body = FixedLayout<
+            int64_t, // timestamp
+            uint8_t, // acknowledged
+            uint16_t>; // name length
+        using Layout = JoinLayouts<HeaderLayout, Body>::type;
+
         template <typename OutT>
         size_t serializeImpl(OutT &out)
         {
-            size_t written = 0;
-
             size_t payloadLength = getPayloadSize(acknowledged, name.size(), extra.size());
-            written += (PacketHeader{MsgType::COMMAND, (uint16_t)payloadLength, sequenceNum}).emit(out);
 
-            written += emit(timestamp, out);
-            written += emit(acknowledged, out);
-            written += emit((int16_t)name.size(), out);
+            size_t written = Layout::store(out, MsgType::COMMAND, (uint16_t)payloadLength, sequenceNum,
+                timestamp, (uint8_t)acknowledged, (uint16_t)name.size());
+
             out = std::copy(name.begin(), name.end(), out);
             written += name.size();
 
             // If we are just an ack, then we don't transmit the body in order to save net bandwidth
             if (!acknowledged)
             {
-                written += emit((int16_t)extra.size(), out);
+                written += FixedLayout<uint16_t>::store(out, (uint16_t)extra.size());
                 out = std::copy(extra.begin(), extra.end(), out);
                 written += extra.size();
             }
@@ -480,53 +635,74 @@ namespace librobocol
             return written;
         }
 
-        template <typename ItrT>
-        ItrT parse(ItrT begin, ItrT end)
+        // Serialize as a head of the fixed fields and views of name and extra, which stay in backing,
+        // so a large command goes out without its strings being copied
+        size_t gather(GatherBuf &out)
         {
-            auto bytesLeft = [&](){ return end - begin; };
-
-            MsgType type = MsgType::EMPTY;
-            uint16_t payloadLength = 0;
-
-            //assert(end - begin > 5);
-            if (end - begin <= 5) { printf("Parse fail 1\n"); return begin; }
+            size_t payloadLength = getPayloadSize(acknowledged, name.size(), extra.size());
 
-            read(begin, end, type);
-            //assert(type == MsgType::COMMAND);
-            if (type != MsgType::COMMAND) { printf("Parse fail 2\n"); return begin; }
+            char *head = out.allocHead(Layout::SIZE + sizeof(uint16_t));
+            char *pos = head;
+            Layout::store(pos, MsgType::COMMAND, (uint16_t)payloadLength, sequenceNum,
+                timestamp, (uint8_t)acknowledged, (uint16_t)name.size());
+            out.add(head, pos - head);
+            out.add(name.data(), name.size());
 
+            if (!acknowledged)
+            {
+                char *extraLength = pos;
+                FixedLayout<uint16_t>::store(pos, (uint16_t)extra.size());
+                out.add(extraLength, pos - extraLength);
+                out.add(extra.data(), extra.size());
+            }
 
-            read(begin, end, payloadLength);
-            read(begin, end, sequenceNum);
+            out.keep(backing);
+            return out.size();
+        }
 
-            read(begin, end, timestamp);
-            read(begin, end, acknowledged);
+        // name and extra view the datagram's bytes, and the command keeps a share of it so they stay
+        // valid for as long as the command (or a copy of it) is around
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
 
+            uint8_t ack = 0;
             uint16_t nameLength = 0;
-            read(begin, end, nameLength);
-            //assert(nameLength < 1000 && nameLength < bytesLeft);
-            if (nameLength > 1000) { printf("Parse fail 3\n"); return begin; }
-            if (nameLength > bytesLeft()) { printf("Parse fail 4 (packet too small)\n"); return begin; }
-
-            name.resize(nameLength, '\0');
-            std::copy(begin, begin + nameLength, name.data());
-            begin += nameLength;
+            reader.take(Body{}, timestamp, ack, nameLength);
 
-            if (!acknowledged)
+            if (!reader.fits(nameLength))
             {
-                uint16_t extraLength = 0;
-                read(begin, end, extraLength);
+                return ParseError::BAD_STRING;
+            }
 
-                if (extraLength > bytesLeft()) { printf("Parse fail 5 (packet too small)\n"); return begin; }
+            sequenceNum = header.sequenceNum;
+            acknowledged = ack != 0;
+            name = reader.takeString(nameLength);
+            extra = {};
 
-                extra.resize(extraLength, '\0');
-                std::copy(begin, begin + extraLength /*end*/, extra.data());
-                begin += extraLength;
+            // Acks leave the body off
+            if (!acknowledged)
+            {
+                if (!reader.fits(sizeof(uint16_t)))
+                {
+                    return ParseError::BAD_SIZE;
+                }
+
+                uint16_t extraLength = reader.take<uint16_t>();
+                if (!reader.fits(extraLength))
+                {
+                    return ParseError::BAD_STRING;
+                }
+
+                extra = reader.takeString(extraLength);
             }
 
-            printf("finished parsing\n");
+            backing = datagram.share();
 
-            return begin;
+            return ParseError::NONE;
         }
     };
 
@@ -560,43 +736,60 @@ namespace librobocol
 
         GamepadPacket() {}
 
+        static constexpr MsgType TYPE = MsgType::GAMEPAD;
+
+        using Body = FixedLayout<
+            uint8_t, // ROBOCOL_GAMEPAD_VERSION
+            int32_t, // id
+            int64_t, // timestamp
+            float, // left_stick_x
+            float, // left_stick_y
+            float, // right_stick_x
+            float, // right_stick_y
+            float, // left_trigger
+            float, // right_trigger
+            int32_t, // buttons
+            uint8_t, // user
+            uint8_t, // legacy type
+            uint8_t, // type
+            float, // touchpad_finger_1_x
+            float, // touchpad_finger_1_y
+            float, // touchpad_finger_2_x
+            float>; // touchpad_finger_2_y
+        using Layout = JoinLayouts<HeaderLayout, Body>::type;
+        static_assert(Layout::SIZE == BUFFER_SIZE);
+
         template <typename OutT>
         size_t serializeImpl(OutT &out)
         {
-            size_t written = 0;
-
-            size_t payloadLength = BUFFER_SIZE - 5;
-            written += (PacketHeader{MsgType::GAMEPAD, (uint16_t)payloadLength, sequenceNum}).emit(out);
-            printf("starting %d ", written);
-
-            written += emit(ROBOCOL_GAMEPAD_VERSION, out);
-            written += emit(id, out);
-            written += emit(currentTimeNs(), out); // timestamp
-            written += emit(left_stick_x, out); // left_stick_x
-            written += emit(left_stick_y, out); // left_stick_y
-            written += emit(right_stick_x, out); // right_stick_x
-            written += emit(right_stick_y, out); // right_stick_y
-            written += emit(left_trigger, out); // left_trigger
-            written += emit(right_trigger, out); // right_trigger
-            written += emit(buttons, out);   // buttons
-            printf("%d ", written);
-
-
-            written += emit(user, out);
-            written += emit((uint8_t)LegacyType::LOGITECH_F310, out);
-            written += emit((uint8_t)LegacyType::LOGITECH_F310, out);
-            printf("%d", written);
-
+            return Layout::store(out, MsgType::GAMEPAD, (uint16_t)PAYLOAD_SIZE, sequenceNum,
+                ROBOCOL_GAMEPAD_VERSION, id, currentTimeNs(),
+                left_stick_x, left_stick_y, right_stick_x, right_stick_y, left_trigger, right_trigger,
+                buttons, user, (uint8_t)LegacyType::LOGITECH_F310, (uint8_t)LegacyType::LOGITECH_F310,
+                touchpad_finger_1_x, touchpad_finger_1_y, 0.0f, 0.0f);
+        }
 
-            written += emit(touchpad_finger_1_x, out); // touchpad_finger_1_x
-            written += emit(touchpad_finger_1_y, out); // touchpad_finger_1_y
-            written += emit(0.0f, out); // touchpad_finger_2_x
-            written += emit(0.0f, out); // touchpad_finger_2_y
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
 
-            printf("%d\n", written);
+            uint8_t version = 0;
+            int64_t timestamp = 0;
+            uint8_t legacyType = 0;
+            uint8_t type = 0;
+            float touchpad_finger_2_x = 0.0f;
+            float touchpad_finger_2_y = 0.0f;
+            reader.take(Body{}, version, id, timestamp,
+                left_stick_x, left_stick_y, right_stick_x, right_stick_y, left_trigger, right_trigger,
+                buttons, user, legacyType, type,
+                touchpad_finger_1_x, touchpad_finger_1_y, touchpad_finger_2_x, touchpad_finger_2_y);
 
+            sequenceNum = header.sequenceNum;
 
-            return written;
+            return ParseError::NONE;
         }
 
     #ifdef GEKKO
@@ -647,8 +840,9 @@ namespace librobocol
 
             return packet;
         }
+    #endif
 
-        bool operator==(GamepadPacket& lhs)
+        bool operator==(const GamepadPacket& lhs) const
         {
             return left_stick_x == lhs.left_stick_x &&
                 left_stick_y == lhs.left_stick_y &&
@@ -665,14 +859,344 @@ namespace librobocol
 
         size_t getSize()
         {
-            return PAYLOAD_SIZE + 5;
+            return Layout::SIZE;
         }
     };
-    #endif
 
+    // Sent by the robot to keep its connection to the driver station alive
+    class KeepAlive : public Packet<KeepAlive>
+    {
+    public:
+        static constexpr MsgType TYPE = MsgType::KEEPALIVE;
+
+        int64_t timestamp = 0;
+
+        using Body = FixedLayout<
+            int64_t>; // timestamp
+        using Layout = JoinLayouts<HeaderLayout, Body>::type;
+
+        template <typename OutT>
+        size_t serializeImpl(OutT &out)
+        {
+            return Layout::store(out, MsgType::KEEPALIVE, (uint16_t)Body::SIZE, sequenceNum, timestamp);
+        }
+
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
+
+            reader.take(Body{}, timestamp);
+            sequenceNum = header.sequenceNum;
+
+            return ParseError::NONE;
+        }
+
+        size_t getSize()
+        {
+            return Layout::SIZE;
+        }
+    };
+
+    // OpMode telemetry sent by the robot
+    //  8 bytes   timestamp
+    //  1 byte    sorted
+    //  1 byte    robot state
+    //  1 byte    tag length, then the tag
+    //  1 byte    string count, then for each: 2 byte key length, key, 2 byte value length, value
+    //  1 byte    number count, then for each: 2 byte key length, key, 4 byte float
+    class Telemetry : public Packet<Telemetry>
+    {
+    public:
+        static constexpr MsgType TYPE = MsgType::TELEMETRY;
+
+        int64_t timestamp = 0;
+        bool sorted = false;
+        RobotState robotState = RobotState::UNKNOWN;
+        std::string_view tag;
+
+        // Entries are walked again by forEachString()/forEachNumber(), which skip the checks parseBody() already made
+        uint8_t stringCount = 0;
+        uint8_t numberCount = 0;
+        const char *strings = nullptr;
+        const char *stringsEnd = nullptr;
+        const char *numbers = nullptr;
+        const char *numbersEnd = nullptr;
+
+        SharedBuf backing;
+
+        static constexpr size_t MAX_ENTRIES = UINT8_MAX;
+
+        using Body = FixedLayout<
+            int64_t, // timestamp
+            uint8_t, // sorted
+            RobotState, // robot state
+            uint8_t>; // tag length
+        using Layout = JoinLayouts<HeaderLayout, Body>::type;
+
+        Telemetry() {}
+
+        // A packet to send. strings holds (key, value) pairs of string_views and numbers holds
+        // (key, float) pairs. Everything is encoded into backing once, up front.
+        // Entries that can't be encoded (more than MAX_ENTRIES of a kind, a tag over 255 bytes, a
+        // key or value over 65535, or a packet over MAX_PACKET_SIZE) give an empty packet instead,
+        // which isValid() is false for.
+        template <typename StringsT, typename NumbersT>
+        static Telemetry forTransmission(std::string_view tag, RobotState state, const StringsT &strings, const NumbersT &numbers)
+        {
+            bool fits = tag.size() <= UINT8_MAX;
+            size_t size = tag.size();
+            size_t stringCount = 0;
+            size_t numberCount = 0;
+            for (const auto &[key, value] : strings)
+            {
+                fits = fits && key.size() <= UINT16_MAX && value.size() <= UINT16_MAX;
+                size += 2 * sizeof(uint16_t) + key.size() + value.size();
+                stringCount++;
+            }
+            for (const auto &[key, value] : numbers)
+            {
+                fits = fits && key.size() <= UINT16_MAX;
+                size += sizeof(uint16_t) + key.size() + sizeof(float);
+                numberCount++;
+            }
+            fits = fits && stringCount <= MAX_ENTRIES && numberCount <= MAX_ENTRIES &&
+                Layout::SIZE + size + 2 * sizeof(uint8_t) <= MAX_PACKET_SIZE;
+
+            Telemetry result;
+            if (!fits)
+            {
+                return result;
+            }
+
+            result.takeSequenceNum();
+            result.timestamp = currentTimeNs();
+            result.robotState = state;
+            result.stringCount = (uint8_t)stringCount;
+            result.numberCount = (uint8_t)numberCount;
+
+            result.backing = BufCache::getBuf(std::max<size_t>(size, 1));
+            char *out = result.backing.data();
+
+            out = std::copy(tag.begin(), tag.end(), out);
+            result.tag = std::string_view(result.backing.data(), tag.size());
+
+            result.strings = out;
+            for (const auto &[key, value] : strings)
+            {
+                FixedLayout<uint16_t>::store(out, (uint16_t)key.size());
+                out = std::copy(key.begin(), key.end(), out);
+                FixedLayout<uint16_t>::store(out, (uint16_t)value.size());
+                out = std::copy(value.begin(), value.end(), out);
+            }
+            result.stringsEnd = out;
+
+            result.numbers = out;
+            for (const auto &[key, value] : numbers)
+            {
+                FixedLayout<uint16_t>::store(out, (uint16_t)key.size());
+                out = std::copy(key.begin(), key.end(), out);
+                FixedLayout<float>::store(out, value);
+            }
+            result.numbersEnd = out;
+
+            return result;
+        }
+
+        ParseError parseBody(PacketReader &reader, const ParsedHeader &header, FixedBuf &datagram)
+        {
+            if (!reader.fits(Body::SIZE))
+            {
+                return ParseError::BAD_SIZE;
+            }
+
+            uint8_t isSorted = 0;
+            uint8_t tagLength = 0;
+            reader.take(Body{}, timestamp, isSorted, robotState, tagLength);
+            sorted = isSorted != 0;
+
+            if (!reader.fits(tagLength + 1))
+            {
+                return ParseError::BAD_STRING;
+            }
+            tag = reader.takeString(tagLength);
+
+            stringCount = reader.take<uint8_t>();
+            strings = reader.position();
+            for (size_t i = 0; i < stringCount; i++)
+            {
+                if (!skipString(reader) || !skipString(reader))
+                {
+                    return ParseError::BAD_STRING;
+                }
+            }
+            stringsEnd = reader.position();
+
+            if (!reader.fits(1))
+            {
+                return ParseError::BAD_SIZE;
+            }
+
+            numberCount = reader.take<uint8_t>();
+            numbers = reader.position();
+            for (size_t i = 0; i < numberCount; i++)
+            {
+                if (!skipString(reader) || !reader.fits(sizeof(float)))
+                {
+                    return ParseError::BAD_STRING;
+                }
+                reader.skip(sizeof(float));
+            }
+            numbersEnd = reader.position();
+
+            sequenceNum = header.sequenceNum;
+            backing = datagram.share();
+
+            return ParseError::NONE;
+        }
+
+        size_t getSize()
+        {
+            return Layout::SIZE + tag.size() + 1 + (stringsEnd - strings) + 1 + (numbersEnd - numbers);
+        }
+
+        // False for a packet forTransmission() couldn't encode, or one never built or parsed
+        bool isValid() const noexcept
+        {
+            return backing.isValid();
+        }
+
+        template <typename OutT>
+        size_t serializeImpl(OutT &out)
+        {
+            size_t payloadLength = getSize() - HeaderLayout::SIZE;
+
+            size_t written = Layout::store(out, MsgType::TELEMETRY, (uint16_t)payloadLength, sequenceNum,
+                timestamp, (uint8_t)sorted, robotState, (uint8_t)tag.size());
+
+            out = std::copy(tag.begin(), tag.end(), out);
+            written += tag.size();
+
+            written += FixedLayout<uint8_t>::store(out, stringCount);
+            out = std::copy(strings, stringsEnd, out);
+            written += stringsEnd - strings;
+
+            written += FixedLayout<uint8_t>::store(out, numberCount);
+            out = std::copy(numbers, numbersEnd, out);
+            written += numbersEnd - numbers;
+
+            return written;
+        }
+
+        // Serialize as a head of the fixed fields and counts, and views of the tag and entries,
+        // which stay in backing
+        size_t gather(GatherBuf &out)
+        {
+            size_t payloadLength = getSize() - HeaderLayout::SIZE;
+
+            char *head = out.allocHead(Layout::SIZE + 2 * sizeof(uint8_t));
+            char *pos = head;
+            Layout::store(pos, MsgType::TELEMETRY, (uint16_t)payloadLength, sequenceNum,
+                timestamp, (uint8_t)sorted, robotState, (uint8_t)tag.size());
+            out.add(head, pos - head);
+            out.add(tag.data(), tag.size());
+
+            char *count = pos;
+            FixedLayout<uint8_t>::store(pos, stringCount);
+            out.add(count, pos - count);
+            out.add(strings, stringsEnd - strings);
+
+            count = pos;
+            FixedLayout<uint8_t>::store(pos, numberCount);
+            out.add(count, pos - count);
+            out.add(numbers, numbersEnd - numbers);
+
+            out.keep(backing);
+            return out.size();
+        }
+
+        // Call fn(key, value) for each string entry
+        template <typename FuncT>
+        void forEachString(FuncT fn) const
+        {
+            const char *pos = strings;
+            for (size_t i = 0; i < stringCount; i++)
+            {
+                std::string_view key = takeString(pos);
+                std::string_view value = takeString(pos);
+                fn(key, value);
+            }
+        }
+
+        // Call fn(key, value) for each number entry
+        template <typename FuncT>
+        void forEachNumber(FuncT fn) const
+        {
+            const char *pos = numbers;
+            for (size_t i = 0; i < numberCount; i++)
+            {
+                std::string_view key = takeString(pos);
+                float value = loadNet<float>(pos);
+                pos += sizeof(float);
+                fn(key, value);
+            }
+        }
+
+    private:
+        static bool skipString(PacketReader &reader)
+        {
+            if (!reader.fits(sizeof(uint16_t)))
+            {
+                return false;
+            }
+
+            uint16_t len = reader.take<uint16_t>();
+            if (!reader.fits(len))
+            {
+                return false;
+            }
+
+            reader.skip(len);
+            return true;
+        }
+
+        static std::string_view takeString(const char *&pos)
+        {
+            uint16_t len = loadNet<uint16_t>(pos);
+            std::string_view str(pos + sizeof(uint16_t), len);
+            pos += sizeof(uint16_t) + len;
+            return str;
+        }
+    };
+
+    // Any received packet, decoded by the type in its header
     class AnyPacket
     {
-        std::variant<Heartbeat, PeerDiscovery, Command> store;
+    public:
+        std::variant<std::monostate, Heartbeat, GamepadPacket, PeerDiscovery, Command, Telemetry, KeepAlive> store;
+
+        ParseError parse(FixedBuf &datagram)
+        {
+            if (datagram.size() < 1)
+            {
+                return ParseError::TRUNCATED;
+            }
+
+            switch ((MsgType)datagram.data()[0])
+            {
+            case MsgType::HEARTBEAT: return store.emplace<Heartbeat>().parse(datagram);
+            case MsgType::GAMEPAD: return store.emplace<GamepadPacket>().parse(datagram);
+            case MsgType::PEER_DISCOVERY: return store.emplace<PeerDiscovery>(PeerDiscovery::forReceive()).parse(datagram);
+            case MsgType::COMMAND: return store.emplace<Command>().parse(datagram);
+            case MsgType::TELEMETRY: return store.emplace<Telemetry>().parse(datagram);
+            case MsgType::KEEPALIVE: return store.emplace<KeepAlive>().parse(datagram);
+            default:
+                store.emplace<std::monostate>();
+                return ParseError::UNKNOWN_TYPE;
+            }
+        }
     };
 }
 
@@ -0,0 +1,94 @@
+#if !defined(LIBROBOCOL_ROBOCOL_PARSE_H)
+#define LIBROBOCOL_ROBOCOL_PARSE_H
+
+#include <cstdint>
+#include <string_view>
+
+#include "layout.h"
+
+namespace librobocol
+{
+    // Why a datagram was rejected
+    enum class ParseError : uint8_t
+    {
+        NONE = 0,
+        TRUNCATED, // Shorter than a packet header
+        LENGTH_MISMATCH, // Header claims a payload longer than the datagram
+        WRONG_TYPE, // Header type is not the packet being parsed
+        BAD_SIZE, // Payload too short for the packet's fixed fields
+        BAD_STRING, // A length-prefixed string or list runs past the payload
+        UNKNOWN_TYPE // No packet is defined for the header type
+    };
+
+    constexpr const char *parseErrorName(ParseError error)
+    {
+        switch (error)
+        {
+        case ParseError::NONE: return "none";
+        case ParseError::TRUNCATED: return "truncated";
+        case ParseError::LENGTH_MISMATCH: return "length mismatch";
+        case ParseError::WRONG_TYPE: return "wrong type";
+        case ParseError::BAD_SIZE: return "bad size";
+        case ParseError::BAD_STRING: return "bad string";
+        case ParseError::UNKNOWN_TYPE: return "unknown type";
+        }
+        return "?";
+    }
+
+    // Forward cursor over a payload whose length has already been checked against the datagram
+    // Reads are unchecked. Parsers check a fixed run of fields once with fits() before taking them,
+    // and each variable-length string once before taking its bytes.
+    class PacketReader
+    {
+        const char *pos;
+        const char *end;
+
+    public:
+        PacketReader(const char *begin, const char *end) : pos(begin), end(end) {}
+
+        bool fits(size_t bytes) const
+        {
+            return bytes <= size_t(end - pos);
+        }
+
+        size_t remaining() const
+        {
+            return end - pos;
+        }
+
+        const char *position() const
+        {
+            return pos;
+        }
+
+        template <typename T>
+        T take()
+        {
+            T val = loadNet<T>(pos);
+            pos += sizeof(T);
+            return val;
+        }
+
+        // Decode a whole layout at once
+        template <typename... Fields>
+        void take(FixedLayout<Fields...>, Fields &...values)
+        {
+            FixedLayout<Fields...>::load(pos, values...);
+            pos += FixedLayout<Fields...>::SIZE;
+        }
+
+        std::string_view takeString(size_t len)
+        {
+            std::string_view str(pos, len);
+            pos += len;
+            return str;
+        }
+
+        void skip(size_t len)
+        {
+            pos += len;
+        }
+    };
+}
+
+#endif // if !defined(LIBROBOCOL_ROBOCOL_PARSE_H)
@@ -1,75 +1,299 @@
 #if !defined(LIBROBOCOL_SYNC_H)
 #define LIBROBOCOL_SYNC_H
 
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <system_error>
+
+#include "clock.h"
+
+#ifdef GEKKO // Macro present when code is compiled for the GC and Wii
+#include <ogc/irq.h>
+#include <ogc/semaphore.h>
+#else
+#include <semaphore>
+#include <thread>
+#endif
+
+// Locks count acquisitions, contention and hold time when this is 1. Costs two clock reads per
+// acquisition, so it defaults to off in release builds.
+#ifndef LIBROBOCOL_LOCK_STATS
+#ifdef NDEBUG
+#define LIBROBOCOL_LOCK_STATS 0
+#else
+#define LIBROBOCOL_LOCK_STATS 1
+#endif
+#endif
+
 // Usage:
 // In the scope you want to be syncronized, put:
 // auto l = lock();
-#define SYNCHRONIZED_CLASS                           \
-    Mutex accessM;                              \
-    LockGuardMutex lock()               \
+// The _WITH forms take the lock type, SpinLock for sections of a few loads and stores.
+#define SYNCHRONIZED_CLASS_WITH(MutexT)              \
+    MutexT accessM;                                  \
+    LockGuard<MutexT> lock()                         \
+    {                                                \
+        return LockGuard<MutexT>(accessM);           \
+    }                                                \
+    librobocol::LockStats lockStats() const          \
     {                                                \
-        return {accessM}; \
+        return accessM.getStats();                   \
     }
 
-#define STATIC_SYNCHRONIZED_CLASS                    \
-    static Mutex accessM;      \
-    static LockGuardMutex lock()        \
+#define STATIC_SYNCHRONIZED_CLASS_WITH(MutexT)       \
+    static MutexT accessM;                           \
+    static LockGuard<MutexT> lock()                  \
     {                                                \
-        return {accessM}; \
+        return LockGuard<MutexT>(accessM);           \
+    }                                                \
+    static librobocol::LockStats lockStats()         \
+    {                                                \
+        return accessM.getStats();                   \
     }
 
+#define SYNCHRONIZED_CLASS SYNCHRONIZED_CLASS_WITH(Mutex)
+#define STATIC_SYNCHRONIZED_CLASS STATIC_SYNCHRONIZED_CLASS_WITH(Mutex)
 
-// Implementation of a mutex that chooses between std::mutex (if present) and the wii/gamecube specific libogc mutex implementation
 
-#ifdef GEKKO // Macro present when code is compiled for the GC and Wii
+namespace librobocol
+{
 
-#include <mutex.h>
-#include <system_error>
+// What a lock has been through, with LIBROBOCOL_LOCK_STATS on. All zero with it off.
+struct LockStats
+{
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0; // Acquisitions that found the lock held and had to wait
+    int64_t heldNs = 0; // Total time held, over all acquisitions
+    int64_t maxHeldNs = 0; // Longest single hold
+};
 
-namespace librobocol
+// Keeps a lock's LockStats. Only touched by the thread holding the lock, so it needs no atomics.
+class LockStatsRecorder
 {
+#if LIBROBOCOL_LOCK_STATS
+    LockStats stats;
+    int64_t acquiredAtNs = 0;
 
-class mutex
+public:
+    void acquired(bool contended)
+    {
+        stats.acquisitions++;
+        stats.contended += contended;
+        acquiredAtNs = currentTimeNs();
+    }
+
+    void releasing()
+    {
+        int64_t heldNs = currentTimeNs() - acquiredAtNs;
+        stats.heldNs += heldNs;
+        stats.maxHeldNs = std::max(stats.maxHeldNs, heldNs);
+    }
+
+    // Exact only when read with the lock held
+    LockStats get() const
+    {
+        return stats;
+    }
+
+    void reset()
+    {
+        stats = LockStats();
+    }
+#else
+public:
+    void acquired(bool) {}
+    void releasing() {}
+    LockStats get() const { return LockStats(); }
+    void reset() {}
+#endif
+};
+
+// Where threads that find a mutex held go to sleep
+class semaphore
 {
-    mutex_t handle;
+#ifdef GEKKO
+    sem_t handle;
 
 public:
-    mutex()
+    semaphore()
     {
         int err = -999;
-        if ((err = LWP_MutexInit(&handle, true /*Recursive*/)) < 0) 
+        if ((err = LWP_SemInit(&handle, 0, UINT32_MAX)) < 0)
         {
             throw std::error_code(err, std::system_category());
         }
     }
+
+    void acquire()
+    {
+        LWP_SemWait(handle);
+    }
+
+    void release()
+    {
+        LWP_SemPost(handle);
+    }
+
+    ~semaphore()
+    {
+        LWP_SemDestroy(handle);
+    }
+#else
+    std::counting_semaphore<> handle{0};
+
+public:
+    semaphore() = default;
+
+    void acquire()
+    {
+        handle.acquire();
+    }
+
+    void release()
+    {
+        handle.release();
+    }
+#endif
+
+    semaphore(const semaphore&) = delete;
+    semaphore& operator=(const semaphore&) = delete;
+};
+
+// Non-recursive mutex that only enters the kernel when another thread holds it
+// waiters counts the holder plus every thread waiting. Taking a free mutex is one atomic increment
+// from 0 and handing it back with nobody waiting one decrement, so an uncontended lock never
+// sleeps or makes a syscall. A thread that finds it held sleeps on the semaphore, and unlock()
+// wakes exactly one sleeper, which then owns the mutex. Locking it again from the thread that
+// holds it deadlocks.
+class mutex
+{
+    std::atomic<int32_t> waiters = 0;
+    semaphore sleepers;
+    LockStatsRecorder stats;
+
+public:
+    mutex() = default;
     mutex(const mutex&) = delete;
+    mutex& operator=(const mutex&) = delete;
 
     void lock()
     {
-        int err = -999;
-        if ((err = LWP_MutexLock(handle)) < 0) 
+        bool contended = waiters.fetch_add(1, std::memory_order_acquire) > 0;
+        if (contended)
         {
-            throw std::error_code(err, std::system_category());
+            sleepers.acquire();
         }
+        stats.acquired(contended);
     }
 
     bool try_lock()
     {
-        int err = -999;
-        if ((err = LWP_MutexTryLock(handle)) < 0 || err == 1) 
+        int32_t expected = 0;
+        if (!waiters.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed))
         {
             return false;
         }
+        stats.acquired(false);
         return true;
     }
 
     void unlock()
     {
-        int err = -999;
-        if ((err = LWP_MutexLock(handle)) < 0) 
+        stats.releasing();
+        if (waiters.fetch_sub(1, std::memory_order_release) > 1)
         {
-            throw std::error_code(err, std::system_category());
+            sleepers.release();
+        }
+    }
+
+    LockStats getStats() const
+    {
+        return stats.get();
+    }
+
+    void resetStats()
+    {
+        stats.reset();
+    }
+};
+
+// Lock for critical sections of a few loads and stores, like a free list push or pop
+// The Wii has one core, so spinning can't wait out a holder that was preempted. There it masks
+// interrupts instead, which is how libogc guards its own short sections: nothing can preempt the
+// holder, so it is never contended. Elsewhere it spins on a flag and yields after a while. Either
+// way, nothing that can block (allocating included) may run while it is held.
+class spinlock
+{
+#ifdef GEKKO
+    u32 level = 0;
+#else
+    static constexpr int SPINS_BEFORE_YIELD = 64;
+
+    std::atomic_flag flag;
+#endif
+    LockStatsRecorder stats;
+
+public:
+    spinlock() = default;
+    spinlock(const spinlock&) = delete;
+    spinlock& operator=(const spinlock&) = delete;
+
+    void lock()
+    {
+#ifdef GEKKO
+        level = IRQ_Disable();
+        stats.acquired(false);
+#else
+        bool contended = false;
+        while (flag.test_and_set(std::memory_order_acquire))
+        {
+            contended = true;
+            for (int spins = 0; flag.test(std::memory_order_relaxed); spins++)
+            {
+                if (spins >= SPINS_BEFORE_YIELD)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        stats.acquired(contended);
+#endif
+    }
+
+    bool try_lock()
+    {
+#ifdef GEKKO
+        lock();
+        return true;
+#else
+        if (flag.test_and_set(std::memory_order_acquire))
+        {
+            return false;
         }
+        stats.acquired(false);
+        return true;
+#endif
+    }
+
+    void unlock()
+    {
+        stats.releasing();
+#ifdef GEKKO
+        IRQ_Restore(level);
+#else
+        flag.clear(std::memory_order_release);
+#endif
+    }
+
+    LockStats getStats() const
+    {
+        return stats.get();
+    }
+
+    void resetStats()
+    {
+        stats.reset();
     }
 };
 
@@ -79,11 +303,14 @@ class lock_guard
     MutexT& mutex;
 
 public:
-    lock_guard(MutexT& _mutex) : mutex(_mutex) 
+    lock_guard(MutexT& _mutex) : mutex(_mutex)
     {
         mutex.lock();
     }
 
+    lock_guard(const lock_guard&) = delete;
+    lock_guard& operator=(const lock_guard&) = delete;
+
     ~lock_guard()
     {
         mutex.unlock();
@@ -93,25 +320,11 @@ public:
 }
 
 using Mutex = librobocol::mutex;
+using SpinLock = librobocol::spinlock;
 
 template <typename MutexT>
 using LockGuard = librobocol::lock_guard<MutexT>;
 
 using LockGuardMutex = librobocol::lock_guard<Mutex>;
 
-#else
-
-// Just use the standard libraries' version when present
-
-#include <mutex>
-
-using Mutex = std::mutex;
-
-template <typename MutexT>
-using LockGuard = std::lock_guard<MutexT>;
-
-using LockGuardMutex = std::lock_guard<Mutex>;
-
-#endif
-
-#endif // if !defined(LIBROBOCOL_SYNC_H)
\ No newline at end of file
+#endif // if !defined(LIBROBOCOL_SYNC_H)
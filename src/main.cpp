@@ -10,20 +10,39 @@
 #include <debug.h>
 #include <errno.h>
 #include <wiiuse/wpad.h>
+#include <fat.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <utility>
 #include <vector>
+#include <array>
+#include <algorithm>
 #include <system_error>
 
 #include <debug/vector>
 
 #include "robocol/DriverStation.h"
 #include "robocol/handlers.h"
+#include "robocol/NetworkThread.h"
+#include "robocol/TelemetryTable.h"
+#include "Capture.h"
 
 using namespace librobocol;
 
+// The screen is redrawn, and queued log messages printed, once per video frame
+constexpr int64_t FRAME_INTERVAL_NS = 16'666'667;
+
+// Log messages printed per frame, so a burst can't stall the loop
+constexpr size_t LOG_FLUSH_PER_FRAME = 32;
+
+// Set to a path like "sd:/robocol.rbcap" to record all robot traffic for tools/replay
+constexpr const char *CAPTURE_PATH = nullptr;
+
+// Telemetry is drawn one line per key from this console row down
+constexpr int TELEMETRY_ROW = 12;
+constexpr int TELEMETRY_WIDTH = 60;
+
 struct local_inet_ntop
 {
 	static constexpr size_t IP_STR_SIZE = 16;
@@ -70,6 +89,70 @@ std::pair<GXRModeObj *, void *> initVideo()
 	return {renderMode, framebuffer};
 }
 
+// What drawTelemetry() last put on screen
+struct TelemetryView
+{
+	uint32_t generation = 0;
+	std::array<bool, TelemetryTable::MAX_KEYS> rowDrawn = {}; // By entry order, from TELEMETRY_ROW down
+};
+
+// Redraw the telemetry lines that changed since the last draw, leaving the cursor where it was
+// Keys past the bottom of the console aren't drawn, and the row of a key the robot stopped sending
+// is blanked.
+void drawTelemetry(const TelemetryTable &telemetry, TelemetryView &view)
+{
+	if (telemetry.getGeneration() == view.generation)
+	{
+		return;
+	}
+
+	int cols = 0;
+	int rows = 0;
+	CON_GetMetrics(&cols, &rows);
+	size_t rowCount = std::min<size_t>(std::max(rows - TELEMETRY_ROW, 0), view.rowDrawn.size());
+
+	std::array<bool, TelemetryTable::MAX_KEYS> rowCurrent = {};
+
+	printf("\x1b[s");
+	telemetry.forEachChangedSince(0, [&](const TelemetryTable::Entry &entry)
+	{
+		if (entry.order >= rowCount || !telemetry.isCurrent(entry))
+		{
+			return;
+		}
+		rowCurrent[entry.order] = true;
+
+		if (entry.changedIn <= view.generation && view.rowDrawn[entry.order])
+		{
+			return;
+		}
+
+		char line[TELEMETRY_WIDTH + 1];
+		if (entry.isNumber)
+		{
+			snprintf(line, sizeof(line), "%s: %g", entry.key.c_str(), entry.number);
+		}
+		else
+		{
+			snprintf(line, sizeof(line), "%s: %s", entry.key.c_str(), entry.text.c_str());
+		}
+		printf("\x1b[%d;0H%-*s", TELEMETRY_ROW + entry.order, TELEMETRY_WIDTH, line);
+		view.rowDrawn[entry.order] = true;
+	});
+
+	for (size_t row = 0; row < view.rowDrawn.size(); row++)
+	{
+		if (view.rowDrawn[row] && !rowCurrent[row])
+		{
+			printf("\x1b[%d;0H%-*s", TELEMETRY_ROW + (int)row, TELEMETRY_WIDTH, "");
+			view.rowDrawn[row] = false;
+		}
+	}
+	printf("\x1b[u");
+
+	view.generation = telemetry.getGeneration();
+}
+
 void initNetwork()
 {
 	in_addr localip = {0};
@@ -94,20 +177,6 @@ void initNetwork()
 	}
 }
 
-lwp_t netFlowHandle = lwp_t(0);
-void *netFlow(void *packetHandlerPtr)
-{
-	// PacketProcessor& packetHandler = *(PacketProcessor*)packetHandlerPtr;
-
-	while (true)
-	{
-
-		usleep(100);
-	}
-
-	return nullptr;
-}
-
 int main(int argc, char *argv[])
 {
 	try 
@@ -118,61 +187,106 @@ int main(int argc, char *argv[])
 
 		initNetwork();
 
-		//DriverStation station("192.168.43.1"); // Rev Control Hub
-		DriverStation station("192.168.43.164"); // motorola phone hotspot
+		//NetworkThread network("192.168.43.1"); // Rev Control Hub
+		NetworkThread network("192.168.43.164", RobocolConnection::ROBOCOL_PORT_DEFAULT,
+			{ .rateHz = 100, .keepaliveNs = 100'000'000 }); // motorola phone hotspot
 
-		
+		Capture capture;
+		if (CAPTURE_PATH != nullptr && fatInitDefault() && capture.open(CAPTURE_PATH))
+		{
+			network.connection.sock.capture = &capture;
+		}
 
-		int64_t time = currentTimeNs();
-		int64_t deltaTime = 0;
-		int64_t videoRefreshDeltaTime = 0;
+		network.start();
 
-		int64_t controllerRefreshDeltaTime = 0;
-		GamepadPacket prevGamepadState = GamepadPacket::fromWiimote(0);
+		ControllerTable controllers;
+		TelemetryTable telemetry;
+		TelemetryView telemetryView;
+		int64_t sampleIntervalNs = network.gamepadSampleIntervalNs();
+		int64_t nextSampleNs = currentTimeNs();
+		int64_t nextFrameNs = nextSampleNs;
 
+		// Input, screen and logging stay here. Sends, keepalives and receives happen on the network
+		// thread, so nothing drawn here can delay a packet.
+		// The loop has two deadlines: sampling the controllers at the streamer's rate, and the video
+		// frame, when the screen is redrawn and the log flushed. It sleeps until the earlier one. The
+		// console draws straight into the one framebuffer, so there is no retrace to wait for.
 		while (1)
 		{
-			int64_t currentTimeCache = currentTimeNs();
-			deltaTime = currentTimeCache - time;
-			time = currentTimeCache;
-
-			SocketPool::tick();
-			station.tick(deltaTime);
-			//printf("alive\n");
-
-			videoRefreshDeltaTime += deltaTime;
-			if (videoRefreshDeltaTime > 1666667)
+			int64_t now = currentTimeNs();
+			if (now >= nextSampleNs)
 			{
-				VIDEO_WaitVSync();
-				videoRefreshDeltaTime = 0;
-			}
-
-			WPAD_ScanPads();
+				WPAD_ScanPads();
 
-			usleep(30);
+				for (int chan = 0; chan < WPAD_MAX_WIIMOTES; chan++)
+				{
+					if (WPAD_ButtonsDown(chan) & WPAD_BUTTON_HOME)
+					{
+						network.stop();
+						capture.close();
+						exit(0);
+					}
+
+					u32 type = 0;
+					bool connected = WPAD_Probe(chan, &type) == WPAD_ERR_NONE;
+
+					controllers.update(chan, connected, connected ? GamepadPacket::fromWiimote(chan) : GamepadPacket(),
+						[&](GamepadPacket &&packet) { return network.sendGamepad(std::move(packet)); });
+				}
 
-			uint32_t buttonsDown = WPAD_ButtonsDown(0);
-			if (buttonsDown & WPAD_BUTTON_HOME)
-			{
-				exit(0);
+				nextSampleNs = std::max(nextSampleNs + sampleIntervalNs, now);
 			}
 
-			controllerRefreshDeltaTime += deltaTime;
-			if (controllerRefreshDeltaTime > 100'000'000 /* .1s */)
+			FixedBuf datagram;
+			while (network.popReceived(datagram))
 			{
-				GamepadPacket newPacket = GamepadPacket::fromWiimote(0);
-				if (newPacket != prevGamepadState)
+				switch ((MsgType)datagram.data()[0])
+				{
+				case MsgType::COMMAND:
 				{
-					station.robotConn.sendPacket(newPacket);
-					prevGamepadState = newPacket;
+					Command command;
+					if (command.parse(datagram) == ParseError::NONE)
+					{
+						printf("Robot sent command %.*s\n", (int)command.name.size(), command.name.data());
+					}
+					break;
 				}
-
-				controllerRefreshDeltaTime = 0;
+				case MsgType::TELEMETRY:
+				{
+					// The network thread only checked its header, so this is the one full parse
+					Telemetry packet;
+					ParseError err = packet.parse(datagram);
+					if (err == ParseError::NONE)
+					{
+						telemetry.update(packet);
+					}
+					else
+					{
+						LOG_WARN("Dropping telemetry: %s\n", parseErrorName(err));
+					}
+					break;
+				}
+				default:
+					break;
+				}
+				datagram = FixedBuf();
 			}
-		}
-
 
+			if (now >= nextFrameNs)
+			{
+				drawTelemetry(telemetry, telemetryView);
+				Log::flush(LOG_FLUSH_PER_FRAME);
+				nextFrameNs = std::max(nextFrameNs + FRAME_INTERVAL_NS, now);
+			}
 
+			// Sleep until whichever is due first, skipping any we fell behind on
+			now = currentTimeNs();
+			int64_t wakeNs = std::min(nextSampleNs, nextFrameNs);
+			if (wakeNs > now)
+			{
+				usleep((wakeNs - now) / 1000);
+			}
+		}
 	}
 	catch (std::system_error& e) 
 	{
@@ -0,0 +1,600 @@
+// Micro-benchmarks for the hot paths, on the host
+//   bench [--filter TEXT] [--ms N] [--port P] [--list]
+// Each benchmark is run in batches that take at least --ms / REPEATS milliseconds, and the fastest
+// batch is reported as ns/op, heap allocations per op, ops/s and MB/s for the ones that move bytes.
+// --filter runs only the benchmarks whose names contain TEXT, so one change can be measured before
+// and after with the same command.
+// --port is where the send benchmarks' receiver listens. The sockets under test bind ephemeral ports.
+// Where the library replaced a slower design (emit()/read() per field, the virtual handler list
+// behind a std::function, copying a large payload to send it), that design is measured as a
+// "baseline" entry next to what replaced it.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <vector>
+#include <string>
+#include <tuple>
+#include <functional>
+#include <algorithm>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "netcompat.h"
+#include "BufCache.h"
+#include "GatherBuf.h"
+#include "UdpSocket.h"
+#include "PacketProcessor.h"
+#include "robocol/handlers.h"
+
+using namespace librobocol;
+
+// Every heap allocation in the process, for allocs/op
+static std::atomic_size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// GCC sees free() meeting a pointer from operator new once these inline, which is the point here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+#pragma GCC diagnostic pop
+
+// Make the compiler believe value is used, so the work producing it isn't optimized away
+template <typename T>
+inline void keep(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Options
+{
+    const char *filter = nullptr;
+    int64_t targetNs = 200'000'000;
+    uint16_t port = 20887;
+    bool list = false;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--list") == 0)
+        {
+            options.list = true;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            options.filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc)
+        {
+            options.targetNs = std::max(1, atoi(argv[++i])) * 1'000'000LL;
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            options.port = (uint16_t)atoi(argv[++i]);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+class Bench
+{
+    static constexpr int REPEATS = 5;
+
+    const Options &options;
+
+    template <typename FnT>
+    static int64_t timeBatch(FnT &fn, size_t iterations)
+    {
+        int64_t startNs = currentTimeNs();
+        for (size_t i = 0; i < iterations; i++)
+        {
+            fn();
+        }
+        return currentTimeNs() - startNs;
+    }
+
+public:
+    explicit Bench(const Options &options) : options(options)
+    {
+        if (!options.list)
+        {
+            printf("%-56s %10s %10s %14s %10s\n", "benchmark", "ns/op", "allocs/op", "ops/s", "MB/s");
+        }
+    }
+
+    bool wants(const char *name) const
+    {
+        return options.filter == nullptr || strstr(name, options.filter) != nullptr;
+    }
+
+    // Time fn(), one op per call. bytesPerOp is what one op moves, 0 if that means nothing.
+    template <typename FnT>
+    void run(const char *name, size_t bytesPerOp, FnT fn)
+    {
+        if (!wants(name))
+        {
+            return;
+        }
+
+        if (options.list)
+        {
+            printf("%s\n", name);
+            return;
+        }
+
+        // Grow the batch until it is long enough to time, which also warms caches and pools
+        int64_t batchNs = options.targetNs / REPEATS;
+        size_t iterations = 1;
+        while (timeBatch(fn, iterations) < batchNs / 4 && iterations < (size_t(1) << 32))
+        {
+            iterations *= 2;
+        }
+        iterations *= 4;
+
+        int64_t bestNs = INT64_MAX;
+        size_t bestAllocs = 0;
+        for (int i = 0; i < REPEATS; i++)
+        {
+            size_t allocsBefore = allocations.load(std::memory_order_relaxed);
+            int64_t ns = timeBatch(fn, iterations);
+            size_t allocs = allocations.load(std::memory_order_relaxed) - allocsBefore;
+
+            if (ns < bestNs)
+            {
+                bestNs = ns;
+                bestAllocs = allocs;
+            }
+        }
+
+        double nsPerOp = (double)bestNs / iterations;
+        printf("%-56s %10.1f %10.2f %14.0f", name, nsPerOp, (double)bestAllocs / iterations, 1e9 / nsPerOp);
+        if (bytesPerOp > 0)
+        {
+            printf(" %10.1f", bytesPerOp * 1e3 / nsPerOp);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+};
+
+// The designs the library moved away from, kept to measure against. emit() and read() are still
+// in packet.h.
+namespace baseline
+{
+    // Every field of a layout, one emit() at a time
+    template <typename OutT, typename... Fields>
+    size_t emitEach(OutT &out, const Fields &...values)
+    {
+        return (librobocol::emit(values, out) + ... + 0);
+    }
+
+    // Handler list and processor as they were, reached through a std::function like UdpSocket did
+    template <typename EnvT>
+    class PacketHandler
+    {
+    public:
+        virtual size_t process(EnvT *env, const char *begin, const char *end) = 0;
+        virtual ~PacketHandler() = default;
+    };
+
+    template <typename EnvT>
+    class PacketProcessor
+    {
+        std::vector<std::unique_ptr<PacketHandler<EnvT>>> handlers;
+
+    public:
+        void addHandler(std::unique_ptr<PacketHandler<EnvT>> &&handler, typename EnvT::MsgType type)
+        {
+            if (handlers.size() <= (size_t)type)
+            {
+                handlers.resize((size_t)type + 1);
+            }
+            handlers[(size_t)type] = std::move(handler);
+        }
+
+        void process(EnvT *env, const char *begin, const char *end)
+        {
+            typename EnvT::MsgType type = (typename EnvT::MsgType)env->peekType(begin, end);
+            if ((size_t)type < handlers.size() && handlers[(size_t)type] != nullptr)
+            {
+                handlers[(size_t)type]->process(env, begin, end);
+            }
+        }
+    };
+}
+
+// An environment whose handlers only count, so dispatch is all that is measured
+struct DispatchEnv
+{
+    using MsgType = librobocol::MsgType;
+
+    size_t handled = 0;
+
+    template <typename ItrT>
+    size_t peekType(ItrT begin, ItrT end)
+    {
+        return (size_t)(uint8_t)*begin;
+    }
+};
+
+template <MsgType Type>
+struct CountingHandler
+{
+    static constexpr MsgType TYPE = Type;
+
+    static size_t process(DispatchEnv *env, FixedBuf &datagram)
+    {
+        env->handled++;
+        return datagram.size();
+    }
+};
+
+template <MsgType Type>
+struct VirtualCountingHandler : baseline::PacketHandler<DispatchEnv>
+{
+    size_t process(DispatchEnv *env, const char *begin, const char *end) override
+    {
+        env->handled++;
+        return end - begin;
+    }
+};
+
+using DispatchTable = PacketProcessor<DispatchEnv,
+    CountingHandler<MsgType::HEARTBEAT>, CountingHandler<MsgType::GAMEPAD>, CountingHandler<MsgType::PEER_DISCOVERY>,
+    CountingHandler<MsgType::COMMAND>, CountingHandler<MsgType::TELEMETRY>, CountingHandler<MsgType::KEEPALIVE>>;
+
+// A serialized packet in a pooled buffer, as it would arrive
+template <typename PacketT>
+FixedBuf datagramOf(PacketT &packet)
+{
+    FixedBuf datagram = BufCache::getBuf(packet.getSize());
+    packet.serialize(datagram.begin());
+    return datagram;
+}
+
+Telemetry sampleTelemetry(size_t keys)
+{
+    static std::vector<std::string> names;
+    while (names.size() < keys)
+    {
+        names.push_back("key" + std::to_string(names.size()));
+    }
+
+    std::vector<std::pair<std::string_view, std::string_view>> strings = {{"opmode", "BenchOpMode"}};
+    std::vector<std::pair<std::string_view, float>> numbers;
+    for (size_t i = 0; i < keys; i++)
+    {
+        numbers.emplace_back(names[i], (float)i);
+    }
+    return Telemetry::forTransmission("bench", RobotState::RUNNING, strings, numbers);
+}
+
+template <typename T>
+void fieldBenchmarks(Bench &bench, const char *typeName)
+{
+    char buf[64] = {};
+    T value = T(0x5a);
+    std::string name;
+
+    name = std::string("field/storeNet/") + typeName;
+    bench.run(name.c_str(), sizeof(T), [&]()
+    {
+        storeNet<T>(buf, value);
+        keep(buf);
+    });
+
+    name = std::string("field/emit (baseline)/") + typeName;
+    bench.run(name.c_str(), sizeof(T), [&]()
+    {
+        FixedBufItr out(buf, buf + sizeof(buf));
+        emit(value, out);
+        keep(buf);
+    });
+
+    name = std::string("field/loadNet/") + typeName;
+    bench.run(name.c_str(), sizeof(T), [&]()
+    {
+        keep(buf);
+        T loaded = loadNet<T>(buf);
+        keep(loaded);
+    });
+
+    name = std::string("field/read (baseline)/") + typeName;
+    bench.run(name.c_str(), sizeof(T), [&]()
+    {
+        keep(buf);
+        const char *in = buf;
+        T loaded;
+        read(in, in + sizeof(T), loaded);
+        keep(loaded);
+    });
+}
+
+// A whole fixed layout stored at once against the same fields emitted one by one
+template <typename... Fields>
+void layoutBenchmarks(Bench &bench, const char *layoutName, FixedLayout<Fields...>)
+{
+    using LayoutT = FixedLayout<Fields...>;
+
+    FixedBuf buf = BufCache::getBuf(LayoutT::SIZE);
+    std::tuple<Fields...> values{};
+    std::string name;
+
+    name = std::string("layout/FixedLayout::store/") + layoutName;
+    bench.run(name.c_str(), LayoutT::SIZE, [&]()
+    {
+        FixedBufItr out = buf.begin();
+        std::apply([&](const Fields &...each) { LayoutT::store(out, each...); }, values);
+        keep(buf.data()[0]);
+    });
+
+    name = std::string("layout/emit per field (baseline)/") + layoutName;
+    bench.run(name.c_str(), LayoutT::SIZE, [&]()
+    {
+        FixedBufItr out = buf.begin();
+        std::apply([&](const Fields &...each) { baseline::emitEach(out, each...); }, values);
+        keep(buf.data()[0]);
+    });
+}
+
+template <typename PacketT>
+void serializeBenchmark(Bench &bench, const char *name, PacketT &packet)
+{
+    FixedBuf buf = BufCache::getBuf(packet.getSize());
+    bench.run(name, packet.getSize(), [&]()
+    {
+        size_t written = packet.serialize(buf.begin());
+        keep(written);
+    });
+}
+
+template <typename PacketT>
+void parseBenchmark(Bench &bench, const char *name, PacketT sample)
+{
+    FixedBuf datagram = datagramOf(sample);
+    bench.run(name, datagram.size(), [&]()
+    {
+        PacketT packet;
+        ParseError err = packet.parse(datagram);
+        keep(err);
+    });
+}
+
+// Writing a command with a large payload and putting it on the loopback, copied into one buffer or
+// gathered from where its strings are
+void sendBenchmarks(Bench &bench, const Options &options)
+{
+    constexpr size_t SIZES[] = {1024, 4096, 16384, 50000};
+    constexpr size_t FLUSH_EVERY = 16;
+
+    auto copyName = [](size_t size) { return "send/copy (baseline)/" + std::to_string(size); };
+    auto gatherName = [](size_t size) { return "send/gather/" + std::to_string(size); };
+
+    if (std::none_of(std::begin(SIZES), std::end(SIZES), [&](size_t size)
+        { return bench.wants(copyName(size).c_str()) || bench.wants(gatherName(size).c_str()); }))
+    {
+        return;
+    }
+
+    // Nothing to set up just to print the names
+    if (options.list)
+    {
+        for (size_t size : SIZES)
+        {
+            bench.run(copyName(size).c_str(), 0, []() {});
+            bench.run(gatherName(size).c_str(), 0, []() {});
+        }
+        return;
+    }
+
+    // The receiver has the port, and the socket sends to it from one the kernel picks
+    sockaddr_in addr;
+    net::makeAddr(addr, "127.0.0.1", options.port);
+    int receiver = net::openUdp();
+    int bufferSize = 16 * 1024 * 1024;
+    setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    if (receiver < 0 || net::bind(receiver, addr) < 0)
+    {
+        fprintf(stderr, "Cannot bind the receiver on port %u, skipping send benchmarks\n", (unsigned)options.port);
+        return;
+    }
+    net::setNonblocking(receiver);
+
+    UdpSocket sock(options.port, "127.0.0.1", [](void *, FixedBuf &) {}, nullptr, UdpSocket::EPHEMERAL_PORT);
+    SocketPool::add(sock);
+    std::vector<char> drain(65536);
+    size_t queued = 0;
+
+    auto flush = [&]()
+    {
+        sock.sendAll();
+        while (recv(receiver, drain.data(), drain.size(), 0) > 0) {}
+        queued = 0;
+    };
+
+    for (size_t size : SIZES)
+    {
+        Command command("CMD_BENCH", std::string(size, 'x'));
+        size_t bytes = command.getSize();
+
+        bench.run(copyName(size).c_str(), bytes, [&]()
+        {
+            FixedBuf buf = BufCache::getBuf(command.getSize());
+            command.serialize(buf.begin());
+            sock.write(std::move(buf));
+            if (++queued == FLUSH_EVERY)
+            {
+                flush();
+            }
+        });
+        flush();
+
+        bench.run(gatherName(size).c_str(), bytes, [&]()
+        {
+            GatherBuf datagram;
+            command.gather(datagram);
+            sock.write(std::move(datagram));
+            if (++queued == FLUSH_EVERY)
+            {
+                flush();
+            }
+        });
+        flush();
+    }
+
+    SocketPool::remove(sock);
+    net::close(receiver);
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--filter TEXT] [--ms N] [--port P] [--list]\n", argv[0]);
+        return 2;
+    }
+
+    Bench bench(options);
+
+    fieldBenchmarks<uint8_t>(bench, "u8");
+    fieldBenchmarks<uint16_t>(bench, "u16");
+    fieldBenchmarks<uint32_t>(bench, "u32");
+    fieldBenchmarks<uint64_t>(bench, "u64");
+    fieldBenchmarks<float>(bench, "float");
+    fieldBenchmarks<double>(bench, "double");
+
+    layoutBenchmarks(bench, "gamepad 65B", GamepadPacket::Layout{});
+    layoutBenchmarks(bench, "peer discovery 13B", PeerDiscovery::Layout{});
+    layoutBenchmarks(bench, "heartbeat header", Heartbeat::Layout{});
+
+    Heartbeat heartbeat = Heartbeat::forTimeSync(currentTimeNs());
+    PeerDiscovery discovery = PeerDiscovery::forTransmission(PeerType::PEER);
+    GamepadPacket gamepad;
+    KeepAlive keepAlive;
+    Command smallCommand("CMD_SMALL", "extra");
+    Command largeCommand("CMD_LARGE", std::string(1024, 'x'));
+    Telemetry telemetry = sampleTelemetry(8);
+
+    serializeBenchmark(bench, "serialize/heartbeat", heartbeat);
+    serializeBenchmark(bench, "serialize/peer discovery", discovery);
+    serializeBenchmark(bench, "serialize/gamepad", gamepad);
+    serializeBenchmark(bench, "serialize/keepalive", keepAlive);
+    serializeBenchmark(bench, "serialize/command 16B", smallCommand);
+    serializeBenchmark(bench, "serialize/command 1KiB", largeCommand);
+    serializeBenchmark(bench, "serialize/telemetry 8 keys", telemetry);
+
+    parseBenchmark(bench, "parse/heartbeat", heartbeat);
+    parseBenchmark(bench, "parse/command 16B", smallCommand);
+    parseBenchmark(bench, "parse/command 1KiB", largeCommand);
+    parseBenchmark(bench, "parse/telemetry 8 keys", telemetry);
+
+    // Dispatch alone, through the table and through the old virtual handlers behind a std::function
+    {
+        DispatchEnv env;
+        FixedBuf datagram = datagramOf(heartbeat);
+
+        bench.run("dispatch/table", 0, [&]()
+        {
+            DispatchTable::process(&env, datagram);
+        });
+
+        baseline::PacketProcessor<DispatchEnv> processor;
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::HEARTBEAT>>(), MsgType::HEARTBEAT);
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::GAMEPAD>>(), MsgType::GAMEPAD);
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::PEER_DISCOVERY>>(), MsgType::PEER_DISCOVERY);
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::COMMAND>>(), MsgType::COMMAND);
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::TELEMETRY>>(), MsgType::TELEMETRY);
+        processor.addHandler(std::make_unique<VirtualCountingHandler<MsgType::KEEPALIVE>>(), MsgType::KEEPALIVE);
+        std::function<void(char *, char *)> receive = std::bind(&baseline::PacketProcessor<DispatchEnv>::process,
+            &processor, &env, std::placeholders::_1, std::placeholders::_2);
+
+        bench.run("dispatch/virtual+std::function (baseline)", 0, [&]()
+        {
+            receive(datagram.data(), datagram.data() + datagram.size());
+        });
+        keep(env.handled);
+    }
+
+    // Dispatch through the robocol handlers, parsing included
+    if (options.list)
+    {
+        bench.run("dispatch/robocol heartbeat", 0, []() {});
+        bench.run("dispatch/robocol telemetry 8 keys", 0, []() {});
+    }
+    else if (bench.wants("dispatch/robocol"))
+    {
+        RobocolConnection connection("127.0.0.1", options.port, UdpSocket::EPHEMERAL_PORT);
+        FixedBuf heartbeatDatagram = datagramOf(heartbeat);
+        FixedBuf telemetryDatagram = datagramOf(telemetry);
+
+        bench.run("dispatch/robocol heartbeat", heartbeatDatagram.size(), [&]()
+        {
+            dispatchRobocolDatagram(&connection, heartbeatDatagram);
+        });
+
+        bench.run("dispatch/robocol telemetry 8 keys", telemetryDatagram.size(), [&]()
+        {
+            dispatchRobocolDatagram(&connection, telemetryDatagram);
+        });
+    }
+
+    for (size_t size : {size_t(64), size_t(1500), MAX_PACKET_SIZE})
+    {
+        bench.run(("bufcache/getBuf+recycle/" + std::to_string(size)).c_str(), 0, [&]()
+        {
+            FixedBuf buf = BufCache::getBuf(size);
+            keep(buf.data());
+            BufCache::recycle(std::move(buf));
+        });
+    }
+
+    {
+        UdpSocket sock;
+        bench.run("udpsocket/write+pop 64B", 64, [&]()
+        {
+            sock.write(BufCache::getBuf(64));
+            GatherBuf datagram = sock.pop();
+            keep(datagram.size());
+        });
+    }
+
+    sendBenchmarks(bench, options);
+
+    if (!options.list)
+    {
+        size_t cls = BufCache::sizeClass(1500);
+        BufCache::LocalStats local = BufCache::getLocalStats(cls);
+        printf("\nBufCache %zu byte class on this thread: %.1f%% of gets and %.1f%% of recycles without locking\n",
+            BufCache::classSize(cls), local.hitRate() * 100, local.recycleRate() * 100);
+    }
+
+    Log::flush();
+    return 0;
+}
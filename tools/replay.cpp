@@ -0,0 +1,150 @@
+// Feeds a capture written by librobocol::Capture through the robocol packet processor
+//   replay <capture> [--max] [--sent] [--repeat N] [--port P]
+// By default received datagrams are fed at the pace they were captured, with the connection's
+// timers running in between. --max feeds them back to back and reports the cost of parsing and
+// dispatch per datagram. --sent feeds the datagrams we sent too. Replies the handlers send are
+// queued on a socket that is never polled, so nothing goes on the wire.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <unistd.h>
+
+#include "clock.h"
+#include "Capture.h"
+#include "robocol/handlers.h"
+
+using namespace librobocol;
+
+constexpr uint16_t REPLAY_PORT_DEFAULT = 20886;
+
+struct Options
+{
+    const char *path = nullptr;
+    bool maxSpeed = false;
+    bool includeSent = false;
+    int repeat = 1;
+    uint16_t port = REPLAY_PORT_DEFAULT;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--max") == 0)
+        {
+            options.maxSpeed = true;
+        }
+        else if (strcmp(argv[i], "--sent") == 0)
+        {
+            options.includeSent = true;
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            options.repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            options.port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && options.path == nullptr)
+        {
+            options.path = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return options.path != nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s <capture> [--max] [--sent] [--repeat N] [--port P]\n", argv[0]);
+        return 2;
+    }
+
+    // Load it all first so reading the file isn't part of the measurement
+    CaptureReader reader;
+    if (!reader.open(options.path))
+    {
+        Log::flush();
+        return 1;
+    }
+
+    std::vector<CaptureReader::Record> records;
+    CaptureReader::Record record;
+    while (reader.next(record))
+    {
+        if (record.datagram.size() > 0 && (options.includeSent || record.direction == Capture::Direction::RECEIVED))
+        {
+            records.push_back(std::move(record));
+        }
+        record = CaptureReader::Record();
+    }
+
+    if (records.empty())
+    {
+        fprintf(stderr, "No datagrams to replay\n");
+        return 1;
+    }
+
+    // Replies are never sent, so any free local port will do
+    RobocolConnection connection("127.0.0.1", options.port, UdpSocket::EPHEMERAL_PORT);
+
+    std::array<size_t, (size_t)MsgType::COUNT + 1> typeCounts = {};
+    size_t bytes = 0;
+
+    int64_t startNs = currentTimeNs();
+    for (int pass = 0; pass < options.repeat; pass++)
+    {
+        int64_t passStartNs = currentTimeNs();
+
+        for (CaptureReader::Record &each : records)
+        {
+            if (!options.maxSpeed)
+            {
+                int64_t dueNs = passStartNs + (each.timeNs - records.front().timeNs);
+                int64_t now = currentTimeNs();
+                if (dueNs > now)
+                {
+                    usleep((dueNs - now) / 1000);
+                }
+                connection.tick(0);
+            }
+
+            size_t type = std::min((size_t)(uint8_t)each.datagram.data()[0], (size_t)MsgType::COUNT);
+            typeCounts[type]++;
+            bytes += each.datagram.size();
+
+            dispatchRobocolDatagram(&connection, each.datagram);
+        }
+
+        // Anything the handlers queued to send would pile up across passes
+        while (connection.sock.pop().isValid()) {}
+    }
+    int64_t elapsedNs = currentTimeNs() - startNs;
+
+    Log::flush();
+
+    size_t datagrams = records.size() * options.repeat;
+    printf("%zu datagrams, %zu bytes in %.3f ms\n", datagrams, bytes, elapsedNs / 1e6);
+    printf("%.1f ns/datagram, %.0f datagrams/s, %.2f MB/s\n", (double)elapsedNs / datagrams,
+        datagrams * 1e9 / elapsedNs, bytes * 1e3 / elapsedNs);
+
+    for (size_t type = 0; type < typeCounts.size(); type++)
+    {
+        if (typeCounts[type] > 0)
+        {
+            printf("  type %zu%s: %zu\n", type, type == (size_t)MsgType::COUNT ? " (unknown)" : "", typeCounts[type]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,534 @@
+// Stands in for a robot controller on the host, speaking robocol over UDP
+//   robotsim [--bind IP] [--port P] [--telemetry-hz N] [--keys N] [--command-hz N]
+//            [--loss P] [--jitter-ms N] [--seconds N]
+//   robotsim --drive IP [--port P] [--command-hz N] [--payload N] [--seconds N]
+// It answers PeerDiscovery, echoes heartbeats with its receive and send times filled in, acks
+// commands and streams telemetry to whoever last discovered it. --loss drops that fraction of
+// datagrams in each direction and --jitter-ms delays each reply by up to that much, reordering
+// them. Once a second it prints what it has seen and sent.
+// The simulator replies to wherever discovery came from, so a RobocolConnection on the same host
+// binds an ephemeral port rather than the one the simulator has.
+// --drive is the other end: a RobocolConnection, as the driver station runs it, against a
+// simulator at IP. It sends a command of --payload bytes --command-hz times a second and once a
+// second prints the heartbeat round trip, what happened to its commands and the bytes each way.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <array>
+#include <queue>
+#include <random>
+#include <string>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "clock.h"
+#include "netcompat.h"
+#include "SocketPool.h"
+#include "robocol/packet.h"
+#include "robocol/handlers.h"
+
+using namespace librobocol;
+
+struct Options
+{
+    const char *bindIp = "127.0.0.1";
+    uint16_t port = 20884; // RobocolConnection::ROBOCOL_PORT_DEFAULT
+    double telemetryHz = 10;
+    int keys = 8;
+    double commandHz = 0;
+    double loss = 0;
+    double jitterMs = 0;
+    double seconds = 0; // Run until killed
+    const char *drive = nullptr; // Robot to drive, instead of simulating one
+    size_t payload = 16; // Bytes of extra on each command the driver sends
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (value == nullptr)
+        {
+            return false;
+        }
+        i++;
+
+        if (strcmp(arg, "--bind") == 0) { options.bindIp = value; }
+        else if (strcmp(arg, "--port") == 0) { options.port = (uint16_t)atoi(value); }
+        else if (strcmp(arg, "--telemetry-hz") == 0) { options.telemetryHz = atof(value); }
+        else if (strcmp(arg, "--keys") == 0) { options.keys = std::clamp(atoi(value), 0, (int)Telemetry::MAX_ENTRIES); }
+        else if (strcmp(arg, "--command-hz") == 0) { options.commandHz = atof(value); }
+        else if (strcmp(arg, "--loss") == 0) { options.loss = atof(value); }
+        else if (strcmp(arg, "--jitter-ms") == 0) { options.jitterMs = atof(value); }
+        else if (strcmp(arg, "--seconds") == 0) { options.seconds = atof(value); }
+        else if (strcmp(arg, "--drive") == 0) { options.drive = value; }
+        else if (strcmp(arg, "--payload") == 0) { options.payload = std::min<size_t>(atol(value), MAX_PACKET_SIZE - 64); } // Room for the rest of the command
+        else { return false; }
+    }
+    return true;
+}
+
+// Time between sends at hz per second, or 0 for none
+int64_t intervalNs(double hz)
+{
+    return hz > 0 ? std::max<int64_t>((int64_t)(1e9 / hz), 1) : 0;
+}
+
+// How long to poll for, to wake by wakeNs
+int pollTimeoutMs(int64_t wakeNs, int64_t nowNs)
+{
+    return (int)std::clamp<int64_t>((wakeNs - nowNs + 999'999) / 1'000'000, 0, 1000);
+}
+
+class RobotSim
+{
+public:
+    struct Stats
+    {
+        std::array<size_t, (size_t)MsgType::COUNT + 1> received = {}; // By type, COUNT for unknown
+        size_t lostIn = 0; // Dropped by --loss on the way in
+        size_t lostOut = 0;
+        size_t sent = 0;
+        size_t acksSent = 0;
+        size_t acksReceived = 0; // For commands we sent
+        size_t telemetrySent = 0;
+        size_t parseErrors = 0;
+    };
+
+private:
+    struct Delayed
+    {
+        int64_t dueNs;
+        std::vector<char> bytes;
+
+        bool operator>(const Delayed &other) const
+        {
+            return dueNs > other.dueNs;
+        }
+    };
+
+    Options options;
+    int sock = -1;
+
+    sockaddr_in peer = {};
+    bool hasPeer = false;
+
+    std::priority_queue<Delayed, std::vector<Delayed>, std::greater<Delayed>> delayed;
+    std::mt19937 rng{12345};
+    std::uniform_real_distribution<double> unit{0, 1};
+
+    std::vector<std::string> keyNames;
+    int64_t nextTelemetryNs = 0;
+    int64_t nextCommandNs = 0;
+    size_t ticks = 0;
+
+    Stats stats;
+
+    bool lose()
+    {
+        return options.loss > 0 && unit(rng) < options.loss;
+    }
+
+    int64_t jitterNs()
+    {
+        return options.jitterMs > 0 ? (int64_t)(unit(rng) * options.jitterMs * 1e6) : 0;
+    }
+
+    // Queue a datagram for the peer, after any jitter. Returns when it will go out.
+    template <typename PacketT>
+    int64_t send(PacketT &packet, int64_t nowNs)
+    {
+        int64_t dueNs = nowNs + jitterNs();
+        if (!hasPeer)
+        {
+            return dueNs;
+        }
+
+        std::vector<char> bytes(packet.getSize());
+        char *out = bytes.data();
+        packet.serialize(out);
+
+        delayed.push(Delayed{dueNs, std::move(bytes)});
+        return dueNs;
+    }
+
+    void flushDue(int64_t nowNs)
+    {
+        while (!delayed.empty() && delayed.top().dueNs <= nowNs)
+        {
+            const std::vector<char> &bytes = delayed.top().bytes;
+            if (lose())
+            {
+                stats.lostOut++;
+            }
+            else if (net::sendTo(sock, bytes.data(), bytes.size(), peer) >= 0)
+            {
+                stats.sent++;
+            }
+            delayed.pop();
+        }
+    }
+
+    void onDatagram(FixedBuf &datagram, const sockaddr_in &from, int64_t nowNs)
+    {
+        MsgType type = (MsgType)datagram.data()[0];
+        stats.received[std::min((size_t)(uint8_t)type, (size_t)MsgType::COUNT)]++;
+
+        switch (type)
+        {
+        case MsgType::PEER_DISCOVERY:
+        {
+            PeerDiscovery packet = PeerDiscovery::forReceive();
+            if (packet.parse(datagram) != ParseError::NONE)
+            {
+                stats.parseErrors++;
+                return;
+            }
+
+            peer = from;
+            hasPeer = true;
+
+            PeerDiscovery reply = PeerDiscovery::forTransmission(PeerType::PEER);
+            send(reply, nowNs);
+            break;
+        }
+        case MsgType::HEARTBEAT:
+        {
+            Heartbeat packet;
+            if (packet.parse(datagram) != ParseError::NONE)
+            {
+                stats.parseErrors++;
+                return;
+            }
+
+            // t2 is when the echo actually leaves, after any jitter
+            int64_t sendNs = nowNs + jitterNs();
+            packet.stampRobotTimes(nowNs, sendNs, RobotState::RUNNING);
+
+            std::vector<char> bytes(packet.getSize());
+            char *out = bytes.data();
+            packet.serialize(out);
+            if (hasPeer)
+            {
+                delayed.push(Delayed{sendNs, std::move(bytes)});
+            }
+            break;
+        }
+        case MsgType::COMMAND:
+        {
+            Command packet;
+            if (packet.parse(datagram) != ParseError::NONE)
+            {
+                stats.parseErrors++;
+                return;
+            }
+
+            if (packet.acknowledged)
+            {
+                stats.acksReceived++;
+                return;
+            }
+
+            Command ack = packet;
+            ack.acknowledged = true;
+            send(ack, nowNs);
+            stats.acksSent++;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void sendTelemetry(int64_t nowNs)
+    {
+        double t = nowNs / 1e9;
+
+        std::vector<std::pair<std::string_view, std::string_view>> strings;
+        std::string tick = std::to_string(ticks++);
+        strings.emplace_back("tick", tick);
+        strings.emplace_back("opmode", "SimOpMode");
+
+        std::vector<std::pair<std::string_view, float>> numbers;
+        for (size_t i = 0; i < keyNames.size(); i++)
+        {
+            // Half the keys change every packet, half hold steady, like a real op mode's telemetry
+            float value = i % 2 == 0 ? (float)std::sin(t + i) : (float)i;
+            numbers.emplace_back(keyNames[i], value);
+        }
+
+        Telemetry packet = Telemetry::forTransmission("sim", RobotState::RUNNING, strings, numbers);
+        send(packet, nowNs);
+        stats.telemetrySent++;
+    }
+
+public:
+    explicit RobotSim(const Options &options) : options(options)
+    {
+        for (int i = 0; i < options.keys; i++)
+        {
+            keyNames.push_back("key" + std::to_string(i));
+        }
+    }
+
+    bool open()
+    {
+        sockaddr_in addr;
+        if (!net::makeAddr(addr, options.bindIp, options.port))
+        {
+            fprintf(stderr, "Bad bind address %s\n", options.bindIp);
+            return false;
+        }
+
+        sock = net::openUdp();
+        if (sock < 0 || net::bind(sock, addr) < 0)
+        {
+            perror("Cannot bind");
+            return false;
+        }
+        net::setNonblocking(sock);
+
+        printf("Robot simulator on %s:%u\n", options.bindIp, (unsigned)options.port);
+        return true;
+    }
+
+    void run()
+    {
+        int64_t startNs = currentTimeNs();
+        int64_t endNs = options.seconds > 0 ? startNs + (int64_t)(options.seconds * 1e9) : INT64_MAX;
+        int64_t nextReportNs = startNs + 1'000'000'000;
+        // A rate of 0 turns the stream off: it is never due, and its interval is never added to
+        int64_t telemetryIntervalNs = intervalNs(options.telemetryHz);
+        int64_t commandIntervalNs = intervalNs(options.commandHz);
+        nextTelemetryNs = telemetryIntervalNs > 0 ? startNs : INT64_MAX;
+        nextCommandNs = commandIntervalNs > 0 ? startNs : INT64_MAX;
+
+        FixedBuf buf = BufCache::getBuf(MAX_PACKET_SIZE);
+
+        for (int64_t now = startNs; now < endNs; now = currentTimeNs())
+        {
+            // Sleep until the next datagram arrives or something is due
+            int64_t wakeNs = std::min({endNs, nextReportNs, nextTelemetryNs, nextCommandNs,
+                delayed.empty() ? INT64_MAX : delayed.top().dueNs});
+            pollfd pfd = {sock, POLLIN, 0};
+            poll(&pfd, 1, pollTimeoutMs(wakeNs, now));
+            now = currentTimeNs();
+
+            while (true)
+            {
+                sockaddr_in from = {};
+                socklen_t fromLen = sizeof(from);
+                buf.len = MAX_PACKET_SIZE;
+                ssize_t n = recvfrom(sock, buf.data(), buf.len, 0, (sockaddr *)&from, &fromLen);
+                if (n <= 0)
+                {
+                    break;
+                }
+
+                if (lose())
+                {
+                    stats.lostIn++;
+                    continue;
+                }
+
+                buf.len = n;
+                onDatagram(buf, from, now);
+
+                // A parsed packet may have kept a share of the buffer
+                if (!buf.unique())
+                {
+                    buf = BufCache::getBuf(MAX_PACKET_SIZE);
+                }
+            }
+
+            if (hasPeer && now >= nextTelemetryNs)
+            {
+                sendTelemetry(now);
+                nextTelemetryNs = std::max(nextTelemetryNs + telemetryIntervalNs, now);
+            }
+
+            if (hasPeer && now >= nextCommandNs)
+            {
+                Command command("CMD_SIM", std::to_string(ticks));
+                send(command, now);
+                nextCommandNs = std::max(nextCommandNs + commandIntervalNs, now);
+            }
+
+            flushDue(now);
+
+            if (now >= nextReportNs)
+            {
+                report(now - startNs);
+                nextReportNs += 1'000'000'000;
+            }
+        }
+
+        report(currentTimeNs() - startNs);
+    }
+
+    void report(int64_t elapsedNs)
+    {
+        const char *names[] = {"empty", "heartbeat", "gamepad", "discovery", "command", "telemetry", "keepalive"};
+
+        printf("%7.1fs in:", elapsedNs / 1e9);
+        for (size_t type = 0; type < stats.received.size(); type++)
+        {
+            if (stats.received[type] > 0)
+            {
+                printf(" %s %zu", type < std::size(names) ? names[type] : "other", stats.received[type]);
+            }
+        }
+        printf(" | out %zu (telemetry %zu, acks %zu) | lost in %zu out %zu | acks back %zu | bad %zu\n",
+            stats.sent, stats.telemetrySent, stats.acksSent, stats.lostIn, stats.lostOut, stats.acksReceived, stats.parseErrors);
+        fflush(stdout);
+    }
+};
+
+// Runs a RobocolConnection against a robot (or a simulator) and reports on the link
+class Driver
+{
+public:
+    struct Stats
+    {
+        size_t commandsQueued = 0;
+        size_t commandsRejected = 0; // Too many already waiting for an ack
+        size_t commandBytes = 0; // Of the commands queued, not counting retransmits
+        size_t delivered = 0; // Telemetry and new commands from the robot
+        size_t deliveredBytes = 0;
+    };
+
+private:
+    static constexpr size_t INBOX_DEPTH = 256;
+
+    Options options;
+    SpscRing<FixedBuf> inbox{INBOX_DEPTH};
+    RobocolConnection connection;
+    std::string payload;
+
+    Stats stats;
+    Stats lastStats;
+    CommandChannel::Stats lastCommands;
+
+public:
+    explicit Driver(const Options &options) :
+        options(options), connection(options.drive, options.port, UdpSocket::EPHEMERAL_PORT), payload(options.payload, 'x')
+    {
+        connection.inbox = &inbox;
+        printf("Driving %s:%u\n", options.drive, (unsigned)options.port);
+    }
+
+    void run()
+    {
+        int64_t startNs = currentTimeNs();
+        int64_t endNs = options.seconds > 0 ? startNs + (int64_t)(options.seconds * 1e9) : INT64_MAX;
+        int64_t lastReportNs = startNs;
+        int64_t nextReportNs = startNs + 1'000'000'000;
+        int64_t commandIntervalNs = intervalNs(options.commandHz);
+        int64_t nextCommandNs = commandIntervalNs > 0 ? startNs : INT64_MAX;
+
+        for (int64_t now = startNs; now < endNs; now = currentTimeNs())
+        {
+            int64_t wakeNs = std::min({endNs, nextReportNs, nextCommandNs, connection.nextDeadlineNs()});
+            SocketPool::tick(pollTimeoutMs(wakeNs, now));
+            now = currentTimeNs();
+
+            connection.tick(0);
+
+            FixedBuf datagram;
+            while (inbox.pop(datagram))
+            {
+                stats.delivered++;
+                stats.deliveredBytes += datagram.size();
+                datagram = FixedBuf();
+            }
+
+            if (connection.link.isConnected() && now >= nextCommandNs)
+            {
+                Command command("CMD_DRIVE", payload);
+                size_t size = command.getSize();
+                if (connection.sendCommand(std::move(command)))
+                {
+                    stats.commandsQueued++;
+                    stats.commandBytes += size;
+                }
+                else
+                {
+                    stats.commandsRejected++;
+                }
+                nextCommandNs = std::max(nextCommandNs + commandIntervalNs, now);
+            }
+
+            if (now >= nextReportNs)
+            {
+                report(now - startNs, now - lastReportNs);
+                lastReportNs = now;
+                nextReportNs += 1'000'000'000;
+            }
+        }
+
+        // Unless the last one was just printed
+        int64_t now = currentTimeNs();
+        if (now - lastReportNs >= 100'000'000)
+        {
+            report(now - startNs, now - lastReportNs);
+        }
+    }
+
+    // Totals, and rates over the last intervalNs
+    void report(int64_t elapsedNs, int64_t intervalNs)
+    {
+        const RttEstimator &latency = connection.latency;
+        const CommandChannel::Stats &commands = connection.commands.getStats();
+        double seconds = std::max<int64_t>(intervalNs, 1) / 1e9;
+
+        printf("%7.1fs %s | rtt %.3f ms min %.3f jitter %.3f lost %zu", elapsedNs / 1e9,
+            PeerLink::stateName(connection.link.getState()), latency.smoothedRttNs() / 1e6,
+            latency.minRttNs() / 1e6, latency.rttJitterNs() / 1e6, latency.lostCount());
+        printf(" | commands %zu acked %zu retx %zu timeouts %zu rejected %zu (%.0f/s acked)",
+            commands.sent, commands.acked, commands.retransmits, commands.timeouts, stats.commandsRejected,
+            (commands.acked - lastCommands.acked) / seconds);
+        printf(" | out %.1f KB/s in %.1f KB/s (%zu delivered)\n",
+            (stats.commandBytes - lastStats.commandBytes) / seconds / 1e3,
+            (stats.deliveredBytes - lastStats.deliveredBytes) / seconds / 1e3, stats.delivered);
+        fflush(stdout);
+
+        lastStats = stats;
+        lastCommands = commands;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--bind IP] [--port P] [--telemetry-hz N] [--keys N] [--command-hz N]\n"
+            "       [--loss P] [--jitter-ms N] [--seconds N]\n"
+            "       %s --drive IP [--port P] [--command-hz N] [--payload N] [--seconds N]\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    if (options.drive != nullptr)
+    {
+        Driver driver(options);
+        driver.run();
+        Log::flush();
+        return 0;
+    }
+
+    RobotSim sim(options);
+    if (!sim.open())
+    {
+        return 1;
+    }
+
+    sim.run();
+    return 0;
+}